@@ -7,6 +7,23 @@
 inline float ffmin(float a, float b) {return a < b ? a : b; }
 inline float ffmax(float a, float b) {return a > b ? a : b; }
 
+// A ray prepared for box tests. The reciprocal of the direction and its
+// signs are computed once per traversal instead of once per node
+struct box_ray {
+    box_ray() {}
+    box_ray(const ray &r) {
+        orig = r.origin();
+        for (int a = 0; a < 3; a++) {
+            inv_dir[a] = 1 / r.direction()[a];
+            sign[a] = inv_dir[a] < 0;
+        }
+    }
+
+    vec3 orig;
+    vec3 inv_dir;
+    int sign[3];
+};
+
 class aabb {
     public:
         aabb() {}
@@ -14,19 +31,32 @@ class aabb {
 
         vec3 min() const { return _min; }
         vec3 max() const { return _max; }
+        vec3 centroid() const { return 0.5*(_min + _max); }
+
+        // Surface area, used by the SAH to estimate the probability
+        // that a ray passing through the parent also hits this box
+        float area() const {
+            vec3 d = _max - _min;
+            return 2*(d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
 
         bool hit(const ray &r, float tmin, float tmax) const {
+            return hit(box_ray(r), tmin, tmax);
+        }
+
+        // Branchless slab test. The sign bits pick the near and far plane
+        // of each slab, so no min/max of the two distances is needed.
+        // A ray parallel to a slab has an infinite inv_dir. If its origin
+        // lies on a plane, 0 * inf gives NaN, and the comparisons below are
+        // written so a NaN leaves tmin and tmax unchanged
+        bool hit(const box_ray &r, float tmin, float tmax) const {
             for (int a = 0; a < 3; a++) {
-                float t0 = ffmin((_min[a] - r.origin()[a]) / r.direction()[a],
-                                (_max[a] - r.origin()[a]) / r.direction()[a]);
-                float t1 = ffmax((_min[a] - r.origin()[a]) / r.direction()[a],
-                                (_max[a] - r.origin()[a]) / r.direction()[a]);
-                tmin = ffmax(t0, tmin);
-                tmax = ffmin(t1, tmax);
-                if (tmax <= tmin)
-                    return false;
+                float t0 = ((r.sign[a] ? _max[a] : _min[a]) - r.orig[a]) * r.inv_dir[a];
+                float t1 = ((r.sign[a] ? _min[a] : _max[a]) - r.orig[a]) * r.inv_dir[a];
+                tmin = t0 > tmin ? t0 : tmin;
+                tmax = t1 < tmax ? t1 : tmax;
             }
-            return true;
+            return tmin <= tmax;
         }
 
         vec3 _min;
@@ -43,4 +73,14 @@ aabb surrounding_box(aabb box0, aabb box1) {
     return aabb(small,big);
 }
 
+// A box that contains nothing. Growing it by any box yields that box
+aabb empty_box() {
+    return aabb(vec3(MAXFLOAT, MAXFLOAT, MAXFLOAT), vec3(-MAXFLOAT, -MAXFLOAT, -MAXFLOAT));
+}
+
+aabb surrounding_box(aabb box, const vec3 &p) {
+    return aabb(vec3(ffmin(box.min().x(), p.x()), ffmin(box.min().y(), p.y()), ffmin(box.min().z(), p.z())),
+                vec3(ffmax(box.max().x(), p.x()), ffmax(box.max().y(), p.y()), ffmax(box.max().z(), p.z())));
+}
+
 #endif
@@ -0,0 +1,109 @@
+#ifndef ARENAH
+#define ARENAH
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+// What the bytes of an arena hold, for the memory report
+enum arena_category { primitive_memory, material_memory, texture_memory, accel_memory, list_memory,
+                      arena_categories };
+
+const char *arena_category_names[arena_categories] = {
+    "primitives", "materials", "textures", "bvh nodes", "lists"
+};
+
+// Blocks start on a cache line
+const size_t arena_block_alignment = 64;
+
+// A monotonic bump allocator. Objects are carved one after another out of
+// large aligned blocks, so objects made together sit together in memory.
+// Nothing is freed on its own: release() drops every block at once, in time
+// that does not depend on the number of objects. Destructors do not run,
+// so only objects that own no other memory belong here
+class arena {
+    public:
+        arena(size_t block = 1 << 20) : reserved(0), block_size(block), cur(nullptr), end(nullptr) {
+            for (int c = 0; c < arena_categories; c++)
+                used[c] = 0;
+        }
+        ~arena() { release(); }
+
+        void *allocate(size_t size, size_t align, arena_category c);
+
+        template <class T, class... Args>
+        T *make(arena_category c, Args&&... args) {
+            return new (allocate(sizeof(T), alignof(T), c)) T(std::forward<Args>(args)...);
+        }
+
+        template <class T>
+        T *make_array(size_t n, arena_category c) {
+            T *a = static_cast<T*>(allocate(n * sizeof(T), alignof(T), c));
+            for (size_t i = 0; i < n; i++)
+                new (a + i) T();
+            return a;
+        }
+
+        void release();
+        void print_usage(const char *name) const;
+
+        // Bytes handed out per category, and bytes held in blocks
+        size_t used[arena_categories];
+        size_t reserved;
+
+    private:
+        arena(const arena&);
+        arena &operator=(const arena&);
+
+        std::vector<void*> blocks;
+        size_t block_size;
+        char *cur;
+        char *end;
+};
+
+void *arena::allocate(size_t size, size_t align, arena_category c) {
+    uintptr_t p = (uintptr_t(cur) + align - 1) & ~uintptr_t(align - 1);
+    if (!cur || p + size > uintptr_t(end)) {
+        // Requests larger than a block get a block of their own
+        size_t bytes = size + align > block_size ? size + align : block_size;
+        bytes = (bytes + arena_block_alignment - 1) & ~(arena_block_alignment - 1);
+        void *block = aligned_alloc(arena_block_alignment, bytes);
+        if (!block)
+            throw std::bad_alloc();
+        blocks.push_back(block);
+        reserved += bytes;
+        cur = static_cast<char*>(block);
+        end = cur + bytes;
+        p = (uintptr_t(cur) + align - 1) & ~uintptr_t(align - 1);
+    }
+    cur = reinterpret_cast<char*>(p + size);
+    used[c] += size;
+    return reinterpret_cast<void*>(p);
+}
+
+void arena::release() {
+    for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+    blocks.clear();
+    cur = end = nullptr;
+    reserved = 0;
+    for (int c = 0; c < arena_categories; c++)
+        used[c] = 0;
+}
+
+void arena::print_usage(const char *name) const {
+    size_t total = 0;
+    for (int c = 0; c < arena_categories; c++)
+        total += used[c];
+    fprintf(stderr, "%s memory: %.1f KB used of %.1f KB in %zu blocks\n", name, total / 1024.0,
+            reserved / 1024.0, blocks.size());
+    for (int c = 0; c < arena_categories; c++) {
+        if (used[c] > 0)
+            fprintf(stderr, "  %-10s %10.1f KB\n", arena_category_names[c], used[c] / 1024.0);
+    }
+}
+
+#endif
@@ -0,0 +1,576 @@
+#ifndef BENCHH
+#define BENCHH
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include "aabb.h"
+#include "random.h"
+#include "camera.h"
+#include "material.h"
+#include "linear_bvh.h"
+#include "bvh.h"
+#include "bvh_update.h"
+#include "bvh4.h"
+#include "motion_bvh.h"
+#include "moving_sphere.h"
+#include "arena.h"
+#include "hittable_list.h"
+#include "render.h"
+
+// Micro benchmarks, run with --bench <name>
+
+// Timed sections are repeated and the fastest run is reported
+const int bench_runs = 5;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The original slab test, which divides by the direction for every
+// plane of every box. Kept to measure the precomputed reciprocal against
+bool slab_hit_divide(const aabb &box, const ray &r, float tmin, float tmax) {
+    for (int a = 0; a < 3; a++) {
+        float t0 = ffmin((box.min()[a] - r.origin()[a]) / r.direction()[a],
+                         (box.max()[a] - r.origin()[a]) / r.direction()[a]);
+        float t1 = ffmax((box.min()[a] - r.origin()[a]) / r.direction()[a],
+                         (box.max()[a] - r.origin()[a]) / r.direction()[a]);
+        tmin = ffmax(t0, tmin);
+        tmax = ffmin(t1, tmax);
+        if (tmax <= tmin)
+            return false;
+    }
+    return true;
+}
+
+// Test every ray against a run of boxes, the access pattern of a BVH
+// traversal. Some rays are made parallel to an axis to exercise the
+// infinite reciprocal path
+void bench_aabb() {
+    const int n_boxes = 4096;
+    const int n_rays = 4096;
+    rng random;
+    std::vector<aabb> boxes(n_boxes);
+    for (int i = 0; i < n_boxes; i++) {
+        vec3 c(20*random.next_float() - 10, 20*random.next_float() - 10, 20*random.next_float() - 10);
+        vec3 h(random.next_float(), random.next_float(), random.next_float());
+        boxes[i] = aabb(c - h, c + h);
+    }
+    std::vector<ray> rays(n_rays);
+    for (int i = 0; i < n_rays; i++) {
+        vec3 o(4*random.next_float() - 2, 4*random.next_float() - 2, 4*random.next_float() - 2);
+        vec3 d(2*random.next_float() - 1, 2*random.next_float() - 1, 2*random.next_float() - 1);
+        if (i % 16 == 0)
+            d[i % 3] = 0;
+        rays[i] = ray(o, d);
+    }
+
+    long long tests = (long long)n_boxes * n_rays;
+    long long hits_divide = 0, hits_slab = 0, mismatches = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < n_rays; r++)
+        for (int b = 0; b < n_boxes; b++)
+            hits_divide += slab_hit_divide(boxes[b], rays[r], 0.001, MAXFLOAT);
+    double divide_s = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < n_rays; r++) {
+        box_ray br(rays[r]);
+        for (int b = 0; b < n_boxes; b++)
+            hits_slab += boxes[b].hit(br, 0.001, MAXFLOAT);
+    }
+    double slab_s = seconds_since(start);
+
+    for (int r = 0; r < n_rays; r++) {
+        box_ray br(rays[r]);
+        for (int b = 0; b < n_boxes; b += 7)
+            mismatches += slab_hit_divide(boxes[b], rays[r], 0.001, MAXFLOAT) != boxes[b].hit(br, 0.001, MAXFLOAT);
+    }
+
+    fprintf(stderr, "aabb: %lld ray-box tests\n", tests);
+    fprintf(stderr, "  divide per plane: %.3f s, %.1f Mtests/s, %lld hits\n", divide_s, tests / divide_s * 1e-6, hits_divide);
+    fprintf(stderr, "  reciprocal slab:  %.3f s, %.1f Mtests/s, %lld hits\n", slab_s, tests / slab_s * 1e-6, hits_slab);
+    fprintf(stderr, "  speedup %.2fx, %lld disagreements\n", divide_s / slab_s, mismatches);
+}
+
+// Closest hit queries against the scene with and without packed sphere
+// leaves. Half the rays are camera rays, the other half start at random
+// points in the scene bounds and go in random directions, like bounces
+void bench_spheres(hittable_list *scene, camera &cam) {
+    const int n_rays = 1 << 18;
+    linear_bvh virtual_leaves(scene->list, scene->list_size, 0.0, 1.0, false);
+    linear_bvh packed_leaves(scene->list, scene->list_size, 0.0, 1.0, true);
+
+    // Bounce rays start inside the box around the small spheres
+    aabb bounds(vec3(-12, 0, -12), vec3(12, 2, 12));
+    std::vector<ray> rays(n_rays);
+    rng random;
+    for (int i = 0; i < n_rays; i += 2) {
+        rays[i] = cam.get_ray(random.next_float(), random.next_float(), random);
+        vec3 o = bounds.min() + vec3(random.next_float(), random.next_float(), random.next_float()) * (bounds.max() - bounds.min());
+        vec3 d = random_in_unit_sphere(random);
+        rays[i+1] = ray(o, d, random.next_float());
+    }
+
+    linear_bvh *bvhs[2] = { &virtual_leaves, &packed_leaves };
+    const char *names[2] = { "virtual sphere::hit leaves", "packed SIMD sphere leaves" };
+    double seconds[2];
+    std::vector<float> ts[2];
+    for (int k = 0; k < 2; k++) {
+        ts[k].resize(n_rays);
+        long long hits = 0;
+        seconds[k] = MAXFLOAT;
+        // Keep the best of a few runs to filter out noise from other load
+        for (int run = 0; run < bench_runs; run++) {
+            hits = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < n_rays; i++) {
+                hit_record rec;
+                ts[k][i] = bvhs[k]->hit(rays[i], 0.001, MAXFLOAT, rec) ? rec.t : -1;
+                hits += ts[k][i] >= 0;
+            }
+            seconds[k] = fmin(seconds[k], seconds_since(start));
+        }
+        fprintf(stderr, "  %-28s %5d leaves  %.3f s  %.2f Mrays/s  %lld hits\n", names[k],
+                bvhs[k]->stats.leaves, seconds[k], n_rays / seconds[k] * 1e-6, hits);
+    }
+
+    int mismatches = 0;
+    for (int i = 0; i < n_rays; i++) {
+        if (fabs(ts[0][i] - ts[1][i]) > 1e-3f * fabs(ts[0][i]) + 1e-4f)
+            mismatches++;
+    }
+    fprintf(stderr, "  speedup %.2fx, %d rays disagree on the closest hit\n", seconds[0] / seconds[1], mismatches);
+}
+
+// Primary visibility only: the closest hit of one camera ray per pixel,
+// traced one ray at a time and as packets over the same linear BVH
+void bench_packets(hittable_list *scene, camera &cam, int nx, int ny) {
+    linear_bvh bvh(scene->list, scene->list_size, 0.0, 1.0);
+
+    // Rays are laid out packet by packet, in blocks of pixels
+    std::vector<ray_packet> packets;
+    for (int y = 0; y < ny; y += packet_width) {
+        for (int x = 0; x < nx; x += packet_width) {
+            ray_packet p;
+            rng random[packet_size];
+            float u[packet_size] = {}, v[packet_size] = {};
+            p.count = 0;
+            for (int j = y; j < y + packet_width && j < ny; j++) {
+                for (int i = x; i < x + packet_width && i < nx; i++) {
+                    random[p.count] = pixel_rng(i, j, nx, 0);
+                    u[p.count] = (i + random[p.count].next_float()) / nx;
+                    v[p.count] = (j + random[p.count].next_float()) / ny;
+                    p.count++;
+                }
+            }
+            cam.get_packet(u, v, random, p.count, p.rays);
+            packets.push_back(p);
+        }
+    }
+    long long n_rays = (long long)nx * ny;
+
+    double single_s = MAXFLOAT, packet_s = MAXFLOAT;
+    std::vector<float> single_t, packet_t;
+    for (int run = 0; run < bench_runs; run++) {
+        single_t.clear();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t p = 0; p < packets.size(); p++) {
+            for (int k = 0; k < packets[p].count; k++) {
+                hit_record rec;
+                single_t.push_back(bvh.hit(packets[p].rays[k], 0.001, MAXFLOAT, rec) ? rec.t : -1);
+            }
+        }
+        single_s = fmin(single_s, seconds_since(start));
+
+        packet_t.clear();
+        start = std::chrono::steady_clock::now();
+        for (size_t p = 0; p < packets.size(); p++) {
+            packet_hits hits;
+            bvh.hit_packet(packets[p], 0.001, MAXFLOAT, hits);
+            for (int k = 0; k < packets[p].count; k++)
+                packet_t.push_back(hits.hit[k] ? hits.rec[k].t : -1);
+        }
+        packet_s = fmin(packet_s, seconds_since(start));
+    }
+
+    long long mismatches = 0;
+    for (size_t i = 0; i < single_t.size(); i++)
+        mismatches += single_t[i] != packet_t[i];
+    fprintf(stderr, "packets: %lld primary rays, %dx%d pixels per packet\n", n_rays, packet_width, packet_width);
+    fprintf(stderr, "  single rays: %.4f s, %.2f Mrays/s\n", single_s, n_rays / single_s * 1e-6);
+    fprintf(stderr, "  packets:     %.4f s, %.2f Mrays/s\n", packet_s, n_rays / packet_s * 1e-6);
+    fprintf(stderr, "  speedup %.2fx, %lld rays disagree on the closest hit\n", single_s / packet_s, mismatches);
+}
+
+// A full frame with each integrator. The recursive one is the reference.
+// The wavefront integrator traces the same paths as the iterative one, so
+// those two agree up to float rounding. Russian roulette changes the noise
+// but not the mean
+void bench_integrators(hittable *world, camera &cam, render_settings settings, tile_scheduler &scheduler) {
+    const int n_kinds = 3;
+    const char *names[n_kinds] = { "recursive", "iterative", "wavefront" };
+    integrator_kind kinds[n_kinds] = { recursive_kind, iterative_kind, wavefront_kind };
+    std::vector<framebuffer> fb(n_kinds, framebuffer(settings.nx, settings.ny));
+    render_stats stats[n_kinds];
+    settings.packets = false;
+    for (int k = 0; k < n_kinds; k++) {
+        settings.integrator = kinds[k];
+        stats[k] = render(settings, world, cam, scheduler, fb[k]);
+    }
+
+    int n = settings.nx * settings.ny;
+    long long paths = (long long)n * settings.ns;
+    fprintf(stderr, "integrators: %dx%d pixels, %d samples per pixel, max depth %d, roulette from %d\n",
+            settings.nx, settings.ny, settings.ns, settings.path.max_depth, settings.path.rr_depth);
+    for (int k = 0; k < n_kinds; k++) {
+        // Against the reference, and the wavefront against the iterative
+        const framebuffer &ref = fb[k == 2 ? 1 : 0];
+        double mean = 0, sq_diff = 0;
+        for (int i = 0; i < n; i++) {
+            for (int c = 0; c < 3; c++) {
+                float a = fb[k].pixels[i][c], b = ref.pixels[i][c];
+                mean += a;
+                sq_diff += (a - b) * (a - b);
+            }
+        }
+        fprintf(stderr, "  %-10s %.3f s  %.2f Mrays/s  %.2f rays per path  mean %.5f  rms vs %s %.2e\n",
+                names[k], stats[k].seconds, stats[k].rays / stats[k].seconds * 1e-6,
+                double(stats[k].rays) / paths, mean / (3 * n), names[k == 2 ? 1 : 0], sqrt(sq_diff / (3 * n)));
+    }
+}
+
+// Uniform sampling with ns samples per pixel against adaptive sampling,
+// both measured by their rms error from a reference with 8 times as many
+// samples. The error is taken after gamma correction, as it is displayed
+void bench_adaptive(hittable *world, camera &cam, render_settings settings, tile_scheduler &scheduler) {
+    if (settings.adaptive_threshold <= 0)
+        settings.adaptive_threshold = 0.05;
+    if (settings.integrator == wavefront_kind)
+        settings.integrator = iterative_kind;
+    settings.packets = false;
+
+    const char *names[3] = { "reference", "uniform", "adaptive" };
+    std::vector<framebuffer> fb(3, framebuffer(settings.nx, settings.ny));
+    render_stats stats[3];
+    for (int k = 0; k < 3; k++) {
+        render_settings s = settings;
+        if (k == 0)
+            s.ns = 8 * settings.ns;
+        if (k < 2)
+            s.adaptive_threshold = 0;
+        stats[k] = render(s, world, cam, scheduler, fb[k]);
+    }
+
+    int n = settings.nx * settings.ny;
+    fprintf(stderr, "adaptive: %dx%d pixels, uniform %d spp, adaptive %d to %d spp at error %.3f\n",
+            settings.nx, settings.ny, settings.ns, settings.min_spp, settings.max_spp, settings.adaptive_threshold);
+    double rms[3];
+    for (int k = 0; k < 3; k++) {
+        double sq_error = 0;
+        for (int i = 0; i < n; i++) {
+            for (int c = 0; c < 3; c++) {
+                float e = sqrt(fb[k].pixels[i][c]) - sqrt(fb[0].pixels[i][c]);
+                sq_error += e * e;
+            }
+        }
+        rms[k] = sqrt(sq_error / (3 * n));
+        fprintf(stderr, "  %-9s %.3f s  %6.2f spp  %10lld rays  rms error %.5f\n", names[k], stats[k].seconds,
+                double(stats[k].samples) / n, stats[k].rays, rms[k]);
+    }
+    // Uniform error falls as one over the square root of the samples
+    double equal_spp = settings.ns * (rms[1] / rms[2]) * (rms[1] / rms[2]);
+    fprintf(stderr, "  uniform sampling needs about %.1f spp for the adaptive error, %.2fx the adaptive samples\n",
+            equal_spp, equal_spp * n / stats[2].samples);
+}
+
+// Small spheres flying in random directions, each moving magnitude units
+// over the shutter, rendered through the static trees, which bound every
+// sphere by its box swept over the whole shutter, and through the motion
+// BVH. The images only differ by float rounding
+void bench_motion(render_settings settings, tile_scheduler &scheduler) {
+    const int n_spheres = 20000;
+    const int n_magnitudes = 6;
+    const float magnitudes[n_magnitudes] = { 0, 0.25, 0.5, 1, 2, 4 };
+    camera cam(vec3(0, 6, 26), vec3(0, 1, 0), vec3(0, 1, 0), 40, float(settings.nx) / float(settings.ny),
+               0, 26, 0, 1);
+    settings.packets = false;
+    settings.adaptive_threshold = 0;
+
+    fprintf(stderr, "motion: %d spheres, %dx%d pixels, %d samples per pixel\n",
+            n_spheres, settings.nx, settings.ny, settings.ns);
+    for (int m = 0; m < n_magnitudes; m++) {
+        arena memory;
+        rng random(0x6d6f74696f6eULL);
+        hittable **list = memory.make_array<hittable*>(n_spheres + 1, list_memory);
+        list[0] = memory.make<sphere>(primitive_memory, vec3(0, -1000, 0), 1000,
+                                      memory.make<lambertian>(material_memory,
+                                          memory.make<constant_texture>(texture_memory, vec3(0.5, 0.5, 0.5))));
+        for (int i = 1; i <= n_spheres; i++) {
+            vec3 center(20 * random.next_float() - 10, 0.2 + 4 * random.next_float(), 20 * random.next_float() - 10);
+            vec3 move = magnitudes[m] * unit_vector(random_in_unit_sphere(random));
+            list[i] = memory.make<moving_sphere>(primitive_memory, center, center + move, 0.0, 1.0, 0.15,
+                memory.make<lambertian>(material_memory,
+                    memory.make<constant_texture>(texture_memory,
+                        vec3(random.next_float(), random.next_float(), random.next_float()))));
+        }
+
+        const int n_trees = 3;
+        const char *names[n_trees] = { "bvh", "bvh4", "mbvh" };
+        hittable *trees[n_trees];
+        double build_ms[n_trees];
+        bvh_node *bvh = memory.make<bvh_node>(accel_memory, list, n_spheres + 1, 0.0, 1.0, memory);
+        bvh4 quad(list, n_spheres + 1, 0.0, 1.0);
+        motion_bvh mbvh(list, n_spheres + 1, 0.0, 1.0);
+        trees[0] = bvh;
+        trees[1] = &quad;
+        trees[2] = &mbvh;
+        build_ms[0] = bvh->stats->build_ms;
+        build_ms[1] = quad.stats.build_ms;
+        build_ms[2] = mbvh.stats.build_ms;
+
+        fprintf(stderr, "  moving %.2f: motion BVH %d nodes, %d temporal splits, %zu primitive references\n",
+                magnitudes[m], mbvh.stats.nodes, mbvh.temporal_splits, mbvh.prims.size());
+        std::vector<framebuffer> fb(n_trees, framebuffer(settings.nx, settings.ny));
+        render_stats stats[n_trees];
+        for (int k = 0; k < n_trees; k++)
+            stats[k] = render(settings, trees[k], cam, scheduler, fb[k]);
+        int n = settings.nx * settings.ny;
+        for (int k = 0; k < n_trees; k++) {
+            double sq_diff = 0;
+            for (int i = 0; i < n; i++) {
+                for (int c = 0; c < 3; c++) {
+                    float d = fb[k].pixels[i][c] - fb[0].pixels[i][c];
+                    sq_diff += d * d;
+                }
+            }
+            fprintf(stderr, "    %-5s build %7.1f ms  render %.3f s  %6.2f Mrays/s  %.2fx  rms vs bvh %.2e\n",
+                    names[k], build_ms[k], stats[k].seconds, stats[k].rays / stats[k].seconds * 1e-6,
+                    stats[0].seconds / stats[k].seconds, sqrt(sq_diff / (3 * n)));
+        }
+    }
+}
+
+// The binned SAH build of the scene on 1, 2, 4 ... threads up to n_threads,
+// phase by phase. Every build must give the same tree
+void bench_build(hittable_list *scene, int n_threads) {
+    int saved = bvh_build_threads;
+    std::vector<int> reference;
+    float reference_cost = 0;
+    fprintf(stderr, "build: %d primitives\n", scene->list_size);
+    double serial_ms = 0;
+    for (int threads = 1; ; threads = threads * 2 < n_threads ? threads * 2 : n_threads) {
+        bvh_build_threads = threads;
+        bvh_stats best = bvh_stats();
+        best.build_ms = MAXFLOAT;
+        bool same = true;
+        for (int run = 0; run < bench_runs; run++) {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<aabb> boxes = primitive_boxes(scene->list, scene->list_size, 0.0, 1.0, "bench");
+            double bounds_ms = ms_since(start);
+            bvh_builder builder(boxes);
+            add_build_phases(builder.stats, bounds_ms, 0);
+            if (builder.stats.build_ms < best.build_ms)
+                best = builder.stats;
+            if (reference.empty()) {
+                reference = builder.order;
+                reference_cost = builder.stats.sah_cost;
+            }
+            same = same && builder.order == reference && builder.stats.sah_cost == reference_cost;
+        }
+        if (threads == 1)
+            serial_ms = best.build_ms;
+        fprintf(stderr, "  %3d threads  %8.1f ms  %.2fx  bounds %.1f  setup %.1f  tree %.1f ms  %s\n",
+                threads, best.build_ms, serial_ms / best.build_ms, best.bounds_ms, best.setup_ms, best.tree_ms,
+                same ? "same tree" : "DIFFERENT TREE");
+        if (threads >= n_threads)
+            break;
+    }
+    bvh_build_threads = saved;
+}
+
+// Moves k random spheres of the scene and updates a bvh_node tree over
+// them, for k from 1 up to every sphere, against building a new tree.
+// Small moves only need a refit. Spheres scattered across the scene make
+// the refitted tree worse until its subtrees are rebuilt. Afterwards the
+// updated tree must find the same closest hits as a new one
+void bench_refit(hittable_list *scene, camera &cam) {
+    int n = scene->list_size;
+    arena memory;
+    std::vector<hittable*> list(scene->list, scene->list + n);
+    bvh_node *bvh = memory.make<bvh_node>(accel_memory, list.data(), n, 0.0, 1.0, memory);
+    bvh_updater updater(bvh, list.data(), n, 0.0, 1.0, memory);
+
+    // The small spheres, and the box they lie in
+    std::vector<hittable*> movable;
+    aabb bounds = empty_box();
+    for (int i = 0; i < n; i++) {
+        sphere *s = dynamic_cast<sphere*>(list[i]);
+        moving_sphere *m = dynamic_cast<moving_sphere*>(list[i]);
+        if ((s && s->radius <= 1) || (m && m->radius <= 1)) {
+            movable.push_back(list[i]);
+            bounds = surrounding_box(bounds, s ? s->center : m->center0);
+        }
+    }
+    fprintf(stderr, "refit: %d primitives, %zu movable spheres, full build %.2f ms\n",
+            n, movable.size(), bvh->stats->build_ms);
+
+    rng random;
+    const char *modes[2] = { "nudged", "scattered" };
+    for (int mode = 0; mode < 2; mode++) {
+        for (size_t k = 1; ; k = k * 10 < movable.size() ? k * 10 : movable.size()) {
+            for (size_t i = 0; i < k; i++) {
+                hittable *h = movable[random.next_uint() % movable.size()];
+                sphere *s = dynamic_cast<sphere*>(h);
+                moving_sphere *m = dynamic_cast<moving_sphere*>(h);
+                vec3 center = s ? s->center : m->center0;
+                float radius = s ? s->radius : m->radius;
+                if (mode == 0)
+                    center += 0.1f * random_in_unit_sphere(random);
+                else
+                    center = bounds.min() + vec3(random.next_float(), random.next_float(), random.next_float()) *
+                                            (bounds.max() - bounds.min());
+                updater.move_sphere(h, center, radius);
+            }
+            bvh_update_stats u = updater.update();
+
+            arena fresh_memory;
+            std::vector<hittable*> fresh_list(list);
+            bvh_node *fresh = fresh_memory.make<bvh_node>(accel_memory, fresh_list.data(), n, 0.0, 1.0, fresh_memory);
+            fprintf(stderr, "  %-9s %7zu  update %8.2f ms (%7d refitted, %3d rebuilt over %7d)  SAH %.2f  "
+                    "new tree %8.2f ms  SAH %.2f\n", modes[mode], k, u.refit_ms + u.rebuild_ms, u.refitted,
+                    u.rebuilt, u.rebuilt_prims, u.sah_cost, fresh->stats->build_ms, fresh->stats->sah_cost);
+
+            if (k == movable.size()) {
+                const int n_rays = 1 << 16;
+                int mismatches = 0;
+                for (int i = 0; i < n_rays; i++) {
+                    ray r = cam.get_ray(random.next_float(), random.next_float(), random);
+                    hit_record a, b;
+                    bool hit_a = bvh->hit(r, 0.001, MAXFLOAT, a);
+                    bool hit_b = fresh->hit(r, 0.001, MAXFLOAT, b);
+                    if (hit_a != hit_b || (hit_a && a.t != b.t))
+                        mismatches++;
+                }
+                fprintf(stderr, "  %d of %d camera rays disagree with the new tree\n", mismatches, n_rays);
+                break;
+            }
+        }
+    }
+}
+
+// The closest hit in a bvh_node tree, as bvh_node::hit, counting the nodes
+// it visits
+bool counted_hit(const bvh_node *node, const ray &r, float t_min, float t_max, hit_record &rec, long long &visits) {
+    visits++;
+    if (!node->box.hit(r, t_min, t_max))
+        return false;
+    if (node->n_prims > 0) {
+        bool hit_anything = false;
+        for (int i = 0; i < node->n_prims; i++) {
+            if (node->prims[i]->hit(r, t_min, t_max, rec)) {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+    bool hit_left = counted_hit(static_cast<const bvh_node*>(node->left), r, t_min, t_max, rec, visits);
+    bool hit_right = counted_hit(static_cast<const bvh_node*>(node->right), r, t_min, hit_left ? rec.t : t_max, rec, visits);
+    return hit_left || hit_right;
+}
+
+// The scene with every bounded primitive in the tree, and with the
+// oversized ones kept out of it by separate_oversized() as the renderer
+// does. Primitives outside the tree are tested first, then the tree up to
+// their closest hit. Rays are camera rays and bounce rays from inside the
+// box of the primitives in the tree, as in bench_spheres. Reports the
+// bvh_node visits per ray and the speed of bvh_node and bvh4
+void bench_oversized(hittable_list *scene, camera &cam) {
+    const int n_rays = 1 << 18;
+    int n = scene->list_size;
+    std::vector<hittable*> lists[2];
+    lists[0].assign(scene->list, scene->list + n);
+    lists[1] = lists[0];
+    // Planes can never go in a tree
+    int outside[2];
+    outside[0] = separate_oversized(lists[0].data(), n, 0.0, 1.0, INFINITY);
+    outside[1] = separate_oversized(lists[1].data(), n, 0.0, 1.0);
+
+    arena memory;
+    bvh_node *trees[2];
+    for (int k = 0; k < 2; k++)
+        trees[k] = memory.make<bvh_node>(accel_memory, lists[k].data() + outside[k], n - outside[k], 0.0, 1.0, memory);
+    bvh4 wide0(lists[0].data() + outside[0], n - outside[0], 0.0, 1.0);
+    bvh4 wide1(lists[1].data() + outside[1], n - outside[1], 0.0, 1.0);
+    bvh4 *wide[2] = { &wide0, &wide1 };
+
+    aabb bounds = trees[1]->box;
+    std::vector<ray> rays(n_rays);
+    rng random;
+    for (int i = 0; i < n_rays; i += 2) {
+        rays[i] = cam.get_ray(random.next_float(), random.next_float(), random);
+        vec3 o = bounds.min() + vec3(random.next_float(), random.next_float(), random.next_float()) * (bounds.max() - bounds.min());
+        rays[i+1] = ray(o, random_in_unit_sphere(random), random.next_float());
+    }
+
+    fprintf(stderr, "oversized: %d primitives, %d planes, %d kept out of the tree\n", n, outside[0], outside[1]);
+    const char *names[2] = { "one tree", "separated" };
+    double visits[2], seconds[2], wide_seconds[2];
+    std::vector<float> ts[2];
+    for (int k = 0; k < 2; k++) {
+        hittable **out = lists[k].data();
+        // Returns the closest hit of the primitives outside the tree, and
+        // lowers t_max to it
+        auto outside_hit = [&](const ray &r, float &t_max, hit_record &rec) {
+            bool hit = false;
+            for (int j = 0; j < outside[k]; j++) {
+                if (out[j]->hit(r, 0.001, t_max, rec)) {
+                    hit = true;
+                    t_max = rec.t;
+                }
+            }
+            return hit;
+        };
+
+        long long count = 0;
+        ts[k].resize(n_rays);
+        for (int i = 0; i < n_rays; i++) {
+            hit_record rec;
+            float t_max = MAXFLOAT;
+            bool hit = outside_hit(rays[i], t_max, rec);
+            hit = counted_hit(trees[k], rays[i], 0.001, t_max, rec, count) || hit;
+            ts[k][i] = hit ? rec.t : -1;
+        }
+        visits[k] = double(count) / n_rays;
+
+        hittable *accels[2] = { trees[k], wide[k] };
+        double *times[2] = { &seconds[k], &wide_seconds[k] };
+        for (int a = 0; a < 2; a++) {
+            *times[a] = MAXFLOAT;
+            for (int run = 0; run < bench_runs; run++) {
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < n_rays; i++) {
+                    hit_record rec;
+                    float t_max = MAXFLOAT;
+                    outside_hit(rays[i], t_max, rec);
+                    accels[a]->hit(rays[i], 0.001, t_max, rec);
+                }
+                *times[a] = fmin(*times[a], seconds_since(start));
+            }
+        }
+        fprintf(stderr, "  %-10s root area %10.1f  depth %3d  %6.1f nodes visited per ray  "
+                "bvh %.2f Mrays/s  bvh4 %.2f Mrays/s\n", names[k], trees[k]->box.area(), trees[k]->stats->max_depth,
+                visits[k], n_rays / seconds[k] * 1e-6, n_rays / wide_seconds[k] * 1e-6);
+    }
+
+    int mismatches = 0;
+    for (int i = 0; i < n_rays; i++) {
+        if (fabs(ts[0][i] - ts[1][i]) > 1e-3f * fabs(ts[0][i]) + 1e-4f)
+            mismatches++;
+    }
+    fprintf(stderr, "  %.2fx fewer node visits, bvh %.2fx and bvh4 %.2fx faster, %d rays disagree on the closest hit\n",
+            visits[0] / visits[1], seconds[0] / seconds[1], wide_seconds[0] / wide_seconds[1], mismatches);
+}
+
+#endif
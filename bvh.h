@@ -1,19 +1,40 @@
 #ifndef BVHH
 #define BVHH
 
+#include "arena.h"
 #include "hittable.h"
+#include "bvh_build.h"
 
 class bvh_node : public hittable {
     public:
-        bvh_node() {}
-        bvh_node(hittable **l, int n, float time0, float time1);
+        bvh_node() : id(-1), stats(nullptr) {}
+        // Nodes below the root are allocated from memory
+        bvh_node(hittable **l, int n, float time0, float time1, arena &memory);
+
+        // Builds the tree below this node again over l[0, n), which is
+        // reordered. The old nodes below it stay in memory
+        void rebuild(hittable **l, int n, float time0, float time1, arena &memory);
 
         virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
         virtual bool bounding_box(float t0, float t1, aabb &box) const;
 
+        // Interior nodes have two children. Leaves instead test the
+        // n_prims primitives starting at prims
         hittable *left;
         hittable *right;
+        hittable **prims;
+        int n_prims;
+        // The node's index in the tables of a bvh_updater, if any
+        int id;
         aabb box;
+
+        // On the root only, nullptr below. Kept out of the nodes, which
+        // would otherwise each carry a copy
+        bvh_stats *stats;
+
+    private:
+        bvh_node(const bvh_build_node *node, hittable **ordered, arena &memory);
+        void init(const bvh_build_node *node, hittable **ordered, arena &memory);
 };
 
 bool bvh_node::bounding_box(float t0, float t1, aabb &b) const {
@@ -22,88 +43,74 @@ bool bvh_node::bounding_box(float t0, float t1, aabb &b) const {
 }
 
 bool bvh_node::hit(const ray &r, float t_min, float t_max, hit_record& rec) const {
-    if (box.hit(r, t_min, t_max)) {
-        hit_record left_rec, right_rec;
-        bool hit_left = left->hit(r, t_min, t_max, left_rec);
-        bool hit_right = right->hit(r, t_min, t_max, right_rec);
-        if (hit_left && hit_right) {
-            if (left_rec.t < right_rec.t)
-                rec = left_rec;
-            else
-                rec = right_rec;
-            return true;
-        }
-        else if (hit_left) {
-            rec = left_rec;
-            return true;
-        }
-        else if (hit_right) {
-            rec = right_rec;
-            return true;
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    if (n_prims > 0) {
+        bool hit_anything = false;
+        for (int i = 0; i < n_prims; i++) {
+            if (prims[i]->hit(r, t_min, t_max, rec)) {
+                hit_anything = true;
+                t_max = rec.t;
+            }
         }
-        else
-            return false;
+        return hit_anything;
     }
-    else return false;
+
+    // Anything the right child finds must be closer than the left's hit
+    bool hit_left = left->hit(r, t_min, t_max, rec);
+    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    return hit_left || hit_right;
 }
-int box_x_compare (const void * a, const void * b) {
-        aabb box_left, box_right;
-        hittable *ah = *(hittable**)a;
-        hittable *bh = *(hittable**)b;
-        if(!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-                        std::cerr << "no bounding box in bvh_node constructor\n";
-        if ( box_left.min().x() - box_right.min().x() < 0.0  )
-            return -1;
-        else
-            return 1;
+
+// Build with the binned SAH builder. l is reordered in place so that
+// every leaf's primitives are contiguous
+bvh_node::bvh_node(hittable **l, int n, float time0, float time1, arena &memory) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<aabb> boxes = primitive_boxes(l, n, time0, time1, "bvh_node");
+    double bounds_ms = ms_since(start);
+
+    bvh_builder builder(boxes);
+    start = std::chrono::steady_clock::now();
+    std::vector<hittable*> original(l, l + n);
+    for (int i = 0; i < n; i++)
+        l[i] = original[builder.order[i]];
+
+    init(builder.root, l, memory);
+    stats = memory.make<bvh_stats>(accel_memory, builder.stats);
+    stats->bytes = stats->nodes * sizeof(bvh_node);
+    add_build_phases(*stats, bounds_ms, ms_since(start));
 }
 
-int box_y_compare (const void * a, const void * b) {
-        aabb box_left, box_right;
-        hittable *ah = *(hittable**)a;
-        hittable *bh = *(hittable**)b;
-        if(!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-                        std::cerr << "no bounding box in bvh_node constructor\n";
-        if ( box_left.min().y() - box_right.min().y() < 0.0  )
-            return -1;
-        else
-            return 1;
+void bvh_node::rebuild(hittable **l, int n, float time0, float time1, arena &memory) {
+    bvh_builder builder(primitive_boxes(l, n, time0, time1, "bvh_node"));
+    std::vector<hittable*> original(l, l + n);
+    for (int i = 0; i < n; i++)
+        l[i] = original[builder.order[i]];
+    init(builder.root, l, memory);
 }
-int box_z_compare (const void * a, const void * b) {
-        aabb box_left, box_right;
-        hittable *ah = *(hittable**)a;
-        hittable *bh = *(hittable**)b;
-        if(!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-                        std::cerr << "no bounding box in bvh_node constructor\n";
-        if ( box_left.min().z() - box_right.min().z() < 0.0  )
-            return -1;
-        else
-            return 1;
+
+bvh_node::bvh_node(const bvh_build_node *node, hittable **ordered, arena &memory) : stats(nullptr) {
+    init(node, ordered, memory);
 }
 
-bvh_node::bvh_node(hittable **l, int n, float time0, float time1) {
-    int axis = int(3*drand48());
-    if (axis == 0)
-       qsort(l, n, sizeof(hittable *), box_x_compare);
-    else if (axis == 1)
-       qsort(l, n, sizeof(hittable *), box_y_compare);
-    else
-       qsort(l, n, sizeof(hittable *), box_z_compare);
-    if (n == 1) {
-        left = right = l[0];
-    }
-    else if (n == 2) {
-        left = l[0];
-        right = l[1];
+// Children are made in depth first order, so a subtree is contiguous
+void bvh_node::init(const bvh_build_node *node, hittable **ordered, arena &memory) {
+    box = node->box;
+    id = -1;
+    if (node->is_leaf()) {
+        left = right = nullptr;
+        prims = ordered + node->first;
+        n_prims = node->count;
     }
     else {
-        left = new bvh_node(l, n/2, time0, time1);
-        right = new bvh_node(l + n/2, n - n/2, time0, time1);
+        left = new (memory.allocate(sizeof(bvh_node), alignof(bvh_node), accel_memory))
+            bvh_node(node->children[0], ordered, memory);
+        right = new (memory.allocate(sizeof(bvh_node), alignof(bvh_node), accel_memory))
+            bvh_node(node->children[1], ordered, memory);
+        prims = nullptr;
+        n_prims = 0;
     }
-    aabb box_left, box_right;
-    if(!left->bounding_box(time0,time1, box_left) || !right->bounding_box(time0,time1, box_right))
-        std::cerr << "no bounding box in bvh_node constructor\n";
-    box = surrounding_box(box_left, box_right);
 }
 
 #endif
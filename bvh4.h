@@ -0,0 +1,278 @@
+#ifndef BVH4H
+#define BVH4H
+
+#include <vector>
+#include <stdint.h>
+#include "hittable.h"
+#include "bvh_build.h"
+#include "sphere_soa.h"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BVH4_SSE 1
+#endif
+
+// A node of a 4-wide BVH. The boxes of the four children are stored as
+// structure of arrays so one SIMD instruction handles an axis of all four.
+// For child i, count[i] == 0 means child[i] is a node index, and
+// count[i] > 0 means it is a leaf of count[i] primitives starting at
+// child[i]. Unused slots hold an empty box, which no ray can hit.
+// Leaves made only of packed spheres have bvh4_sphere_leaf set in count
+const int bvh4_sphere_leaf = 1 << 30;
+
+struct alignas(16) bvh4_node {
+    float min_x[4], min_y[4], min_z[4];
+    float max_x[4], max_y[4], max_z[4];
+    int child[4];
+    int count[4];
+};
+
+// A BVH with four children per node, built by collapsing the binary SAH
+// tree: every node pulls up the children of its largest interior children
+// until it has four
+class bvh4 : public hittable {
+    public:
+        bvh4() {}
+        bvh4(hittable **l, int n, float time0, float time1);
+
+        virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb &box) const;
+
+        std::vector<bvh4_node> nodes;
+        // Primitives in leaf order
+        std::vector<hittable*> prims;
+        sphere_soa spheres;
+        aabb box;
+        bvh_stats stats;
+
+    private:
+        int collapse(const bvh_build_node *node, int depth);
+        bool hit_leaf(const ray &r, int first, int count, float t_min, float &t_max,
+                      hit_record &rec, int &sphere_index) const;
+};
+
+bvh4::bvh4(hittable **l, int n, float time0, float time1) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<aabb> boxes = primitive_boxes(l, n, time0, time1, "bvh4");
+    double bounds_ms = ms_since(start);
+
+    bool all_spheres = sphere_soa::can_pack(l, n);
+    bvh_builder builder = all_spheres ?
+        bvh_builder(boxes, sphere_leaf_size, sphere_simd_width, sphere_traversal_cost) : bvh_builder(boxes);
+    start = std::chrono::steady_clock::now();
+    prims.resize(n);
+    for (int i = 0; i < n; i++) {
+        prims[i] = l[builder.order[i]];
+        spheres.add(prims[i]);
+    }
+    spheres.finish();
+
+    stats = builder.stats;
+    stats.nodes = 0;
+    stats.max_depth = 0;
+    if (!builder.root) {
+        add_build_phases(stats, bounds_ms, ms_since(start));
+        return;
+    }
+    box = builder.root->box;
+
+    // A root that is a leaf still needs a node to hold it
+    if (builder.root->is_leaf()) {
+        bvh_build_node wrapper;
+        wrapper.box = box;
+        wrapper.count = 0;
+        wrapper.children[0] = builder.root;
+        wrapper.children[1] = nullptr;
+        collapse(&wrapper, 1);
+    }
+    else
+        collapse(builder.root, 1);
+    stats.nodes = int(nodes.size());
+    stats.bytes = nodes.size() * sizeof(bvh4_node) + prims.size() * sizeof(hittable*) + spheres.bytes();
+    add_build_phases(stats, bounds_ms, ms_since(start));
+}
+
+int bvh4::collapse(const bvh_build_node *node, int depth) {
+    if (depth > stats.max_depth)
+        stats.max_depth = depth;
+
+    // Start from the binary children and repeatedly replace the interior
+    // child with the largest surface area by its own two children
+    const bvh_build_node *kids[4] = { node->children[0], node->children[1], nullptr, nullptr };
+    int n_kids = node->children[1] ? 2 : 1;
+    while (n_kids < 4) {
+        int best = -1;
+        float best_area = -1;
+        for (int i = 0; i < n_kids; i++) {
+            if (!kids[i]->is_leaf() && kids[i]->box.area() > best_area) {
+                best = i;
+                best_area = kids[i]->box.area();
+            }
+        }
+        if (best < 0)
+            break;
+        const bvh_build_node *expanded = kids[best];
+        kids[best] = expanded->children[0];
+        kids[n_kids++] = expanded->children[1];
+    }
+
+    int index = int(nodes.size());
+    nodes.push_back(bvh4_node());
+    for (int i = 0; i < 4; i++) {
+        aabb b = i < n_kids ? kids[i]->box : empty_box();
+        nodes[index].min_x[i] = b.min().x();
+        nodes[index].min_y[i] = b.min().y();
+        nodes[index].min_z[i] = b.min().z();
+        nodes[index].max_x[i] = b.max().x();
+        nodes[index].max_y[i] = b.max().y();
+        nodes[index].max_z[i] = b.max().z();
+        nodes[index].child[i] = 0;
+        nodes[index].count[i] = 0;
+    }
+    for (int i = 0; i < n_kids; i++) {
+        if (kids[i]->is_leaf()) {
+            nodes[index].child[i] = kids[i]->first;
+            nodes[index].count[i] = kids[i]->count;
+            if (spheres.packed(kids[i]->first, kids[i]->count))
+                nodes[index].count[i] |= bvh4_sphere_leaf;
+        }
+        else {
+            int c = collapse(kids[i], depth + 1);
+            nodes[index].child[i] = c;
+        }
+    }
+    return index;
+}
+
+bool bvh4::bounding_box(float t0, float t1, aabb &b) const {
+    if (nodes.empty())
+        return false;
+    b = box;
+    return true;
+}
+
+bool bvh4::hit_leaf(const ray &r, int first, int count, float t_min, float &t_max,
+                    hit_record &rec, int &sphere_index) const {
+    if (count & bvh4_sphere_leaf) {
+        float t;
+        int index;
+        if (!spheres.nearest(r, first, count & ~bvh4_sphere_leaf, t_min, t_max, t, index))
+            return false;
+        t_max = t;
+        sphere_index = index;
+        return true;
+    }
+
+    bool hit_anything = false;
+    for (int i = 0; i < count; i++) {
+        if (prims[first + i]->hit(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+            sphere_index = -1;
+        }
+    }
+    return hit_anything;
+}
+
+bool bvh4::hit(const ray &r, float t_min, float t_max, hit_record &rec) const {
+    if (nodes.empty())
+        return false;
+
+    box_ray br(r);
+
+    // Stack entries are (node or leaf, entry distance). Entries whose
+    // entry distance is beyond the closest hit found since are skipped.
+    // Each level pops one entry and pushes at most four, and the tree is
+    // no deeper than the binary one it was collapsed from
+    struct entry {
+        int child;
+        int count;
+        float t;
+    };
+    entry stack[3 * bvh_stack_size + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, t_min};
+    bool hit_anything = false;
+    // The closest packed sphere, whose hit_record is filled in at the end
+    int sphere_index = -1;
+
+#ifdef BVH4_SSE
+    __m128 org_x = _mm_set1_ps(br.orig.x()), org_y = _mm_set1_ps(br.orig.y()), org_z = _mm_set1_ps(br.orig.z());
+    __m128 inv_x = _mm_set1_ps(br.inv_dir.x()), inv_y = _mm_set1_ps(br.inv_dir.y()), inv_z = _mm_set1_ps(br.inv_dir.z());
+#endif
+
+    while (stack_size > 0) {
+        entry e = stack[--stack_size];
+        if (e.t > t_max)
+            continue;
+        if (e.count > 0) {
+            hit_anything |= hit_leaf(r, e.child, e.count, t_min, t_max, rec, sphere_index);
+            continue;
+        }
+
+        const bvh4_node &node = nodes[e.child];
+        float tnear[4];
+        int mask;
+#ifdef BVH4_SSE
+        // The sign bits pick the near and far plane arrays. _mm_max_ps and
+        // _mm_min_ps return their second operand when the first is NaN,
+        // which keeps the running interval for rays on a slab plane
+        const float *near_x = br.sign[0] ? node.max_x : node.min_x;
+        const float *far_x  = br.sign[0] ? node.min_x : node.max_x;
+        const float *near_y = br.sign[1] ? node.max_y : node.min_y;
+        const float *far_y  = br.sign[1] ? node.min_y : node.max_y;
+        const float *near_z = br.sign[2] ? node.max_z : node.min_z;
+        const float *far_z  = br.sign[2] ? node.min_z : node.max_z;
+        __m128 t0 = _mm_set1_ps(t_min);
+        __m128 t1 = _mm_set1_ps(t_max);
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_x), org_x), inv_x), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_x), org_x), inv_x), t1);
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_y), org_y), inv_y), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_y), org_y), inv_y), t1);
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_z), org_z), inv_z), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_z), org_z), inv_z), t1);
+        mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+        _mm_storeu_ps(tnear, t0);
+#else
+        mask = 0;
+        for (int i = 0; i < 4; i++) {
+            aabb b(vec3(node.min_x[i], node.min_y[i], node.min_z[i]),
+                   vec3(node.max_x[i], node.max_y[i], node.max_z[i]));
+            float t0 = t_min, t1 = t_max;
+            for (int a = 0; a < 3; a++) {
+                float s0 = ((br.sign[a] ? b.max()[a] : b.min()[a]) - br.orig[a]) * br.inv_dir[a];
+                float s1 = ((br.sign[a] ? b.min()[a] : b.max()[a]) - br.orig[a]) * br.inv_dir[a];
+                t0 = s0 > t0 ? s0 : t0;
+                t1 = s1 < t1 ? s1 : t1;
+            }
+            tnear[i] = t0;
+            if (t0 <= t1)
+                mask |= 1 << i;
+        }
+#endif
+        if (mask == 0)
+            continue;
+
+        // Push the hit children far to near so the nearest is popped first
+        entry hits[4];
+        int n_hits = 0;
+        for (int i = 0; i < 4; i++) {
+            if (mask & (1 << i)) {
+                entry h = {node.child[i], node.count[i], tnear[i]};
+                int k = n_hits++;
+                while (k > 0 && hits[k-1].t < h.t) {
+                    hits[k] = hits[k-1];
+                    k--;
+                }
+                hits[k] = h;
+            }
+        }
+        for (int i = 0; i < n_hits; i++)
+            stack[stack_size++] = hits[i];
+    }
+    if (sphere_index >= 0)
+        spheres.record(r, sphere_index, t_max, rec);
+    return hit_anything;
+}
+
+#endif
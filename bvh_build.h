@@ -0,0 +1,476 @@
+#ifndef BVHBUILDH
+#define BVHBUILDH
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "aabb.h"
+#include "hittable.h"
+
+// Costs used by the surface area heuristic (SAH), relative to the cost
+// of intersecting one primitive
+const float sah_traversal_cost = 0.125;
+const float sah_intersect_cost = 1.0;
+const int sah_bins = 12;
+// Below this depth nodes are split at the median instead, which adds at
+// most 31 more levels. Flattened trees are walked with bvh_stack_size
+// entries of stack
+const int sah_max_depth = 64;
+const int bvh_stack_size = 128;
+
+// Threads used to build a BVH, 0 for every core. main sets it from --threads
+int bvh_build_threads = 0;
+
+int build_thread_count() {
+    int n = bvh_build_threads > 0 ? bvh_build_threads : int(std::thread::hardware_concurrency());
+    return n < 1 ? 1 : n;
+}
+
+// Ranges smaller than this are not split between threads
+const int parallel_min_chunk = 1 << 15;
+
+// The number of chunks to split n items into on up to threads threads
+int chunk_count(int n, int threads, int min_chunk = parallel_min_chunk) {
+    int chunks = n / min_chunk;
+    chunks = chunks < threads ? chunks : threads;
+    return chunks < 1 ? 1 : chunks;
+}
+
+// Calls f(chunk, begin, end) for each of chunks consecutive ranges of
+// [0, n), the first on the calling thread and the others on threads of
+// their own
+template <typename F>
+void parallel_chunks(int n, int chunks, F f) {
+    std::vector<std::thread> workers;
+    for (int c = 1; c < chunks; c++)
+        workers.push_back(std::thread(f, c, int((long long)n * c / chunks), int((long long)n * (c + 1) / chunks)));
+    f(0, 0, int((long long)n / chunks));
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+// The boxes of l[0, n) over [time0, time1], computed in parallel. who
+// names the structure being built if a primitive has no box
+std::vector<aabb> primitive_boxes(hittable **l, int n, float time0, float time1, const char *who) {
+    std::vector<aabb> boxes(n);
+    std::atomic<bool> missing(false);
+    parallel_chunks(n, chunk_count(n, build_thread_count()), [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            if (!l[i]->bounding_box(time0, time1, boxes[i]))
+                missing = true;
+        }
+    });
+    if (missing)
+        fprintf(stderr, "no bounding box in %s constructor\n", who);
+    return boxes;
+}
+
+// Primitives more than oversized_factor times as large across as the
+// median one are kept out of BVHs, as long as there are no more than
+// max_oversized of them
+const float oversized_factor = 100;
+const int max_oversized = 16;
+
+// Moves the primitives that do not belong in a BVH to the front of l,
+// keeping the order of the rest, and returns how many there are. Those
+// without a bounding box, like infinite planes, can not be bounded at all.
+// An oversized one, like a radius 1000 ground sphere under spheres of
+// radius 0.2, inflates the box of every node on its path from the root, so
+// nearly every ray goes deep into the tree. Tested on its own it costs one
+// intersection per ray
+int separate_oversized(hittable **l, int n, float time0, float time1, float factor = oversized_factor) {
+    if (n == 0)
+        return 0;
+    std::vector<float> size(n);
+    parallel_chunks(n, chunk_count(n, build_thread_count()), [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            aabb box;
+            size[i] = l[i]->bounding_box(time0, time1, box) ? (box.max() - box.min()).length() : INFINITY;
+        }
+    });
+    std::vector<float> sorted(size);
+    std::nth_element(sorted.begin(), sorted.begin() + n/2, sorted.end());
+    float limit = sorted[n/2] * factor;
+    int oversized = 0;
+    for (int i = 0; i < n; i++)
+        oversized += size[i] != INFINITY && size[i] > limit;
+    // Too many to test one by one, they stay in the tree
+    if (oversized > max_oversized)
+        limit = INFINITY;
+
+    std::vector<hittable*> inside;
+    int outside = 0;
+    for (int i = 0; i < n; i++) {
+        if (size[i] == INFINITY || size[i] > limit)
+            l[outside++] = l[i];
+        else
+            inside.push_back(l[i]);
+    }
+    std::copy(inside.begin(), inside.end(), l + outside);
+    return outside;
+}
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A node of the binary tree produced by the builder. Interior nodes have
+// two children, leaves own the range [first, first + count) of the
+// ordered primitive list
+struct bvh_build_node {
+    aabb box;
+    bvh_build_node *children[2];
+    int split_axis;
+    int first, count;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// Summary of a built tree. The SAH cost is the expected cost of tracing a
+// ray through the root, in units of primitive intersections
+struct bvh_stats {
+    int primitives;
+    int nodes;
+    int leaves;
+    int max_depth;
+    float sah_cost;
+    // The whole build, and its phases: the primitive boxes, copying them
+    // with their centroids into flat arrays, binning and partitioning
+    // the tree, and converting it to the final layout
+    double build_ms;
+    double bounds_ms, setup_ms, tree_ms, layout_ms;
+    int build_threads;
+    // Memory held by the finished structure
+    size_t bytes;
+};
+
+void print_bvh_stats(const char *name, const bvh_stats &s) {
+    fprintf(stderr, "%s: %d primitives, %d nodes, %d leaves, depth %d, SAH cost %.2f, %.1f KB, built in %.2f ms\n",
+            name, s.primitives, s.nodes, s.leaves, s.max_depth, s.sah_cost, s.bytes / 1024.0, s.build_ms);
+    if (s.build_ms > 0)
+        fprintf(stderr, "  bounds %.2f ms, setup %.2f ms, tree %.2f ms, layout %.2f ms on %d threads\n",
+                s.bounds_ms, s.setup_ms, s.tree_ms, s.layout_ms, s.build_threads);
+}
+
+// Adds the caller's phases to the builder's stats, which cover only the
+// builder's own
+void add_build_phases(bvh_stats &s, double bounds_ms, double layout_ms) {
+    s.bounds_ms = bounds_ms;
+    s.layout_ms = layout_ms;
+    s.build_ms += bounds_ms + layout_ms;
+}
+
+// Binned SAH builder. Only primitive bounds are needed, so the same
+// builder serves every acceleration structure.
+// At each node the primitives' centroids are binned along all three axes
+// and the split with the lowest estimated cost is taken. A node becomes a
+// leaf when it holds at most max_leaf_size primitives and splitting it is
+// not cheaper than testing them all. Leaves never hold more than
+// max_leaf_size primitives.
+// The boxes and centroids are copied once into a flat array which the
+// build partitions in place. Large subtrees are built as tasks on threads
+// of their own, and near the root, where few tasks run, the passes over a
+// node's primitives are split between the threads as well. The tree does
+// not depend on the number of threads
+class bvh_builder {
+    public:
+        // Leaves that test prims_per_test primitives in one SIMD kernel
+        // are costed per group of primitives rather than per primitive.
+        // traversal_cost is the cost of a node visit relative to one test
+        bvh_builder(const std::vector<aabb> &boxes, int max_leaf_size = 4, int prims_per_test = 1,
+                    float traversal_cost = sah_traversal_cost);
+
+        bvh_build_node *root;
+        // order[k] is the index of the primitive stored at slot k
+        std::vector<int> order;
+        bvh_stats stats;
+
+    private:
+        struct prim_info {
+            aabb box;
+            vec3 centroid;
+            int index;
+        };
+
+        // The bins of a range of primitives along all three axes
+        struct bin_set {
+            int counts[3][sah_bins];
+            aabb boxes[3][sah_bins];
+        };
+
+        // Shared by the tasks of one build
+        struct build_state {
+            std::atomic<int> next_node;
+            // Threads building subtrees, the calling one included
+            std::atomic<int> tasks;
+        };
+
+        bvh_build_node *build(int start, int end, int depth, build_state &state);
+        void bound_range(int start, int end, aabb &bounds, aabb &centroid_bounds) const;
+        void bin_range(int start, int end, const aabb &centroid_bounds, const vec3 &scale, bin_set &bins) const;
+        void gather_stats(const bvh_build_node *node, int depth, float root_area);
+
+        std::vector<prim_info> info;
+        // A binary tree with n leaves has 2n - 1 nodes. They are allocated
+        // up front, uninitialized, so the child pointers stay valid
+        std::unique_ptr<bvh_build_node[]> nodes;
+        int max_leaf;
+        int group;
+        float trav_cost;
+        int threads;
+
+        float leaf_cost(int n) const { return sah_intersect_cost * ((n + group - 1) / group); }
+};
+
+// Subtrees smaller than this are built by the task that made their parent
+const int parallel_task_min = 1 << 14;
+
+bvh_builder::bvh_builder(const std::vector<aabb> &boxes, int max_leaf_size, int prims_per_test,
+                         float traversal_cost)
+    : root(nullptr), max_leaf(max_leaf_size), group(prims_per_test), trav_cost(traversal_cost),
+      threads(build_thread_count()) {
+    auto start = std::chrono::steady_clock::now();
+    int n = int(boxes.size());
+    info.resize(n);
+    parallel_chunks(n, chunk_count(n, threads), [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            info[i].box = boxes[i];
+            info[i].centroid = boxes[i].centroid();
+            info[i].index = i;
+        }
+    });
+    if (n > 0)
+        nodes.reset(new bvh_build_node[2*size_t(n) - 1]);
+    stats.setup_ms = ms_since(start);
+
+    auto tree_start = std::chrono::steady_clock::now();
+    build_state state;
+    state.next_node = 0;
+    state.tasks = 1;
+    if (n > 0)
+        root = build(0, n, 0, state);
+    stats.tree_ms = ms_since(tree_start);
+
+    auto finish_start = std::chrono::steady_clock::now();
+    order.resize(n);
+    parallel_chunks(n, chunk_count(n, threads), [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++)
+            order[i] = info[i].index;
+    });
+    info.clear();
+    info.shrink_to_fit();
+
+    stats.primitives = n;
+    stats.nodes = state.next_node;
+    stats.leaves = 0;
+    stats.max_depth = 0;
+    stats.sah_cost = 0;
+    stats.bytes = 0;
+    stats.build_threads = threads;
+    if (root)
+        gather_stats(root, 1, root->box.area());
+    // Gathering the order and the stats is counted with the setup
+    stats.setup_ms += ms_since(finish_start);
+    stats.bounds_ms = stats.layout_ms = 0;
+    stats.build_ms = ms_since(start);
+}
+
+void bvh_builder::bound_range(int start, int end, aabb &bounds, aabb &centroid_bounds) const {
+    bounds = empty_box();
+    centroid_bounds = empty_box();
+    for (int i = start; i < end; i++) {
+        bounds = surrounding_box(bounds, info[i].box);
+        centroid_bounds = surrounding_box(centroid_bounds, info[i].centroid);
+    }
+}
+
+// One pass bins every primitive along all three axes
+void bvh_builder::bin_range(int start, int end, const aabb &centroid_bounds, const vec3 &scale,
+                            bin_set &bins) const {
+    for (int axis = 0; axis < 3; axis++) {
+        for (int b = 0; b < sah_bins; b++) {
+            bins.counts[axis][b] = 0;
+            bins.boxes[axis][b] = empty_box();
+        }
+    }
+    for (int i = start; i < end; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            int b = int((info[i].centroid[axis] - centroid_bounds.min()[axis]) * scale[axis]);
+            if (b >= sah_bins)
+                b = sah_bins - 1;
+            bins.counts[axis][b]++;
+            bins.boxes[axis][b] = surrounding_box(bins.boxes[axis][b], info[i].box);
+        }
+    }
+}
+
+bvh_build_node *bvh_builder::build(int start, int end, int depth, build_state &state) {
+    bvh_build_node *node = &nodes[state.next_node++];
+    node->children[0] = node->children[1] = nullptr;
+    node->split_axis = 0;
+    node->first = start;
+    node->count = end - start;
+    int n = end - start;
+
+    // At depth d up to 2^d tasks run, which leaves the rest of the
+    // threads to help with this node's passes. Deeper than 30 none are
+    // left, and shifting by 32 or more would be undefined
+    int chunks = chunk_count(n, depth < 31 ? threads >> depth : 0);
+    aabb bounds, centroid_bounds;
+    if (chunks > 1) {
+        std::vector<aabb> b(chunks), c(chunks);
+        parallel_chunks(n, chunks, [&](int k, int from, int to) {
+            bound_range(start + from, start + to, b[k], c[k]);
+        });
+        bounds = b[0];
+        centroid_bounds = c[0];
+        for (int k = 1; k < chunks; k++) {
+            bounds = surrounding_box(bounds, b[k]);
+            centroid_bounds = surrounding_box(centroid_bounds, c[k]);
+        }
+    }
+    else
+        bound_range(start, end, bounds, centroid_bounds);
+    node->box = bounds;
+
+    if (n == 1)
+        return node;
+
+    vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+    vec3 scale;
+    for (int axis = 0; axis < 3; axis++)
+        scale[axis] = extent[axis] > 0 ? sah_bins / extent[axis] : 0;
+    bin_set bins;
+    if (chunks > 1) {
+        std::vector<bin_set> partial(chunks);
+        parallel_chunks(n, chunks, [&](int k, int from, int to) {
+            bin_range(start + from, start + to, centroid_bounds, scale, partial[k]);
+        });
+        bins = partial[0];
+        for (int k = 1; k < chunks; k++) {
+            for (int axis = 0; axis < 3; axis++) {
+                for (int b = 0; b < sah_bins; b++) {
+                    bins.counts[axis][b] += partial[k].counts[axis][b];
+                    bins.boxes[axis][b] = surrounding_box(bins.boxes[axis][b], partial[k].boxes[axis][b]);
+                }
+            }
+        }
+    }
+    else
+        bin_range(start, end, centroid_bounds, scale, bins);
+
+    // Evaluate the cost of splitting after every bin on every axis
+    float inv_area = bounds.area() > 0 ? 1 / bounds.area() : 0;
+    float best_cost = MAXFLOAT;
+    int best_axis = -1;
+    int best_bin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0)
+            continue;
+
+        // Sweep from the right to get the area and count of every suffix,
+        // then from the left to cost each split
+        const int *counts = bins.counts[axis];
+        const aabb *bin_bounds = bins.boxes[axis];
+        float right_area[sah_bins];
+        int right_count[sah_bins];
+        aabb acc = empty_box();
+        int count = 0;
+        for (int b = sah_bins - 1; b > 0; b--) {
+            acc = surrounding_box(acc, bin_bounds[b]);
+            count += counts[b];
+            right_area[b] = count ? acc.area() : 0;
+            right_count[b] = count;
+        }
+        acc = empty_box();
+        count = 0;
+        for (int b = 0; b < sah_bins - 1; b++) {
+            acc = surrounding_box(acc, bin_bounds[b]);
+            count += counts[b];
+            if (count == 0 || right_count[b+1] == 0)
+                continue;
+            float cost = trav_cost + inv_area *
+                         (leaf_cost(count) * acc.area() + leaf_cost(right_count[b+1]) * right_area[b+1]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    int split;
+    if (best_axis < 0 || depth >= sah_max_depth) {
+        // All centroids coincide, so there is no split in space, or the
+        // tree is too deep. Ranges of more than max_leaf primitives are
+        // halved at the median centroid along the widest axis, so leaves
+        // stay small enough for the 16 bit counts of the flat layouts
+        if (n <= max_leaf)
+            return node;
+        best_axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+        int axis = best_axis;
+        split = start + n / 2;
+        std::nth_element(&info[start], &info[split], &info[end - 1] + 1,
+            [=](const prim_info &a, const prim_info &b) { return a.centroid[axis] < b.centroid[axis]; });
+    }
+    else {
+        if (n <= max_leaf && leaf_cost(n) <= best_cost)
+            return node;
+
+        float cmin = centroid_bounds.min()[best_axis];
+        float axis_scale = scale[best_axis];
+        prim_info *mid = std::partition(&info[start], &info[end - 1] + 1,
+            [=](const prim_info &p) {
+                int b = int((p.centroid[best_axis] - cmin) * axis_scale);
+                if (b >= sah_bins)
+                    b = sah_bins - 1;
+                return b <= best_bin;
+            });
+        split = int(mid - &info[0]);
+    }
+
+    node->split_axis = best_axis;
+    node->count = 0;
+    // A large left subtree becomes a task of its own if a thread is free,
+    // while this one goes on with the right
+    bool task = false;
+    if (split - start >= parallel_task_min && end - split >= parallel_task_min) {
+        task = ++state.tasks <= threads;
+        if (!task)
+            state.tasks--;
+    }
+    if (task) {
+        std::thread left([&]() {
+            node->children[0] = build(start, split, depth + 1, state);
+            state.tasks--;
+        });
+        node->children[1] = build(split, end, depth + 1, state);
+        left.join();
+    }
+    else {
+        node->children[0] = build(start, split, depth + 1, state);
+        node->children[1] = build(split, end, depth + 1, state);
+    }
+    return node;
+}
+
+void bvh_builder::gather_stats(const bvh_build_node *node, int depth, float root_area) {
+    float p = root_area > 0 ? node->box.area() / root_area : 1;
+    if (depth > stats.max_depth)
+        stats.max_depth = depth;
+    if (node->is_leaf()) {
+        stats.leaves++;
+        stats.sah_cost += p * leaf_cost(node->count);
+    }
+    else {
+        stats.sah_cost += p * trav_cost;
+        gather_stats(node->children[0], depth + 1, root_area);
+        gather_stats(node->children[1], depth + 1, root_area);
+    }
+}
+
+#endif
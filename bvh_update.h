@@ -0,0 +1,290 @@
+#ifndef BVHUPDATEH
+#define BVHUPDATEH
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <unordered_map>
+#include "arena.h"
+#include "bvh.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+
+// What one bvh_updater::update did
+struct bvh_update_stats {
+    // Primitives moved since the previous update
+    int changed;
+    // Nodes whose bounds were recomputed, subtrees built again and the
+    // primitives under them
+    int refitted;
+    int rebuilt;
+    int rebuilt_prims;
+    // The SAH cost of the whole tree, now and when it was built
+    float sah_cost;
+    float built_sah_cost;
+    double refit_ms;
+    double rebuild_ms;
+};
+
+void print_bvh_update_stats(const bvh_update_stats &s) {
+    fprintf(stderr, "bvh update: %d changed, %d nodes refitted in %.2f ms, %d subtrees of %d primitives rebuilt in %.2f ms, "
+            "SAH cost %.2f (%.2f when built)\n", s.changed, s.refitted, s.refit_ms, s.rebuilt, s.rebuilt_prims,
+            s.rebuild_ms, s.sah_cost, s.built_sah_cost);
+}
+
+// Keeps a bvh_node tree up to date as its spheres move, for animation.
+// Moving a primitive only marks its leaf. update() then recomputes the
+// bounds of the marked leaves and their ancestors, deepest first, one
+// level at a time with the nodes of a level split between threads, so its
+// cost grows with the number of moved primitives rather than the size of
+// the scene.
+// Refitting keeps the tree's topology, which gets worse as primitives
+// wander away from their neighbours. Every node remembers its SAH cost
+// from when it was built, and a refitted node whose cost has grown past
+// rebuild_threshold times that is built again from its primitives
+class bvh_updater {
+    public:
+        // root was built over list[0, n) by the bvh_node constructor, with
+        // its nodes allocated from memory. Rebuilt nodes come from it too
+        bvh_updater(bvh_node *root, hittable **list, int n, float time0, float time1, arena &memory);
+
+        // Places a sphere or moving sphere of the tree at center, which
+        // for a moving sphere is its center at its own time0, and gives it
+        // radius. Returns false for other primitives
+        bool move_sphere(hittable *prim, const vec3 &center, float radius);
+        // For primitives changed some other way
+        void mark_changed(hittable *prim);
+        // Moves the tree to the shutter [t0, t1], as for the next frame of
+        // an animation. Only the primitives that move over time change
+        void set_shutter(float t0, float t1);
+
+        bvh_update_stats update(float rebuild_threshold = 1.25);
+
+    private:
+        struct node_info {
+            bvh_node *node;
+            int parent;
+            int depth;
+            // The slots list[first, first + count) under the node
+            int first, count;
+            float cost, built_cost;
+            bool dirty;
+        };
+
+        int index(bvh_node *node, int parent, int depth, int id = -1);
+        void refit(int id);
+        void rebuild(int id);
+
+        bvh_node *root;
+        hittable **list;
+        float time0, time1;
+        arena &memory;
+        std::vector<node_info> nodes;
+        // The leaf holding each slot, and the slot of each primitive
+        std::vector<int> leaf_of;
+        std::unordered_map<const hittable*, int> slot_of;
+        // Primitives whose bounds change with time
+        std::vector<hittable*> moving;
+        // Leaves with moved primitives since the last update
+        std::vector<int> changed_leaves;
+        int changed;
+};
+
+inline bool same_box(const aabb &a, const aabb &b) {
+    for (int i = 0; i < 3; i++) {
+        if (a.min()[i] != b.min()[i] || a.max()[i] != b.max()[i])
+            return false;
+    }
+    return true;
+}
+
+// Refitting a node is little work, so a level is only split between
+// threads when it holds many nodes
+const int refit_min_chunk = 1 << 12;
+
+bvh_updater::bvh_updater(bvh_node *r, hittable **l, int n, float t0, float t1, arena &m)
+    : root(r), list(l), time0(t0), time1(t1), memory(m), changed(0) {
+    leaf_of.resize(n);
+    slot_of.reserve(n);
+    for (int i = 0; i < n; i++) {
+        slot_of[l[i]] = i;
+        aabb a, b;
+        if (l[i]->bounding_box(t0, t0, a) && l[i]->bounding_box(t0 + 1, t0 + 1, b) &&
+            !same_box(a, b))
+            moving.push_back(l[i]);
+    }
+    index(root, -1, 0);
+}
+
+// Gives the subtree at node new ids from the end of the tables, except
+// for the node itself if it already has id, and returns the node's id.
+// Costs are computed bottom up and taken as the built ones
+int bvh_updater::index(bvh_node *node, int parent, int depth, int id) {
+    if (id < 0) {
+        id = int(nodes.size());
+        nodes.push_back(node_info());
+    }
+    node->id = id;
+    node_info info;
+    info.node = node;
+    info.parent = parent;
+    info.depth = depth;
+    info.dirty = false;
+    if (node->n_prims > 0) {
+        info.first = int(node->prims - list);
+        info.count = node->n_prims;
+        info.cost = sah_intersect_cost * node->n_prims;
+        for (int i = info.first; i < info.first + info.count; i++)
+            leaf_of[i] = id;
+    }
+    else {
+        bvh_node *left = static_cast<bvh_node*>(node->left);
+        bvh_node *right = static_cast<bvh_node*>(node->right);
+        int a = index(left, id, depth + 1);
+        int b = index(right, id, depth + 1);
+        info.first = nodes[a].first;
+        info.count = nodes[a].count + nodes[b].count;
+        float area = node->box.area();
+        info.cost = sah_traversal_cost + (area > 0 ?
+            (left->box.area() * nodes[a].cost + right->box.area() * nodes[b].cost) / area : 0);
+    }
+    info.built_cost = info.cost;
+    nodes[id] = info;
+    return id;
+}
+
+bool bvh_updater::move_sphere(hittable *prim, const vec3 &center, float radius) {
+    if (sphere *s = dynamic_cast<sphere*>(prim)) {
+        s->center = center;
+        s->radius = radius;
+    }
+    else if (moving_sphere *s = dynamic_cast<moving_sphere*>(prim)) {
+        // The motion over the shutter is kept
+        s->center1 = center + (s->center1 - s->center0);
+        s->center0 = center;
+        s->radius = radius;
+    }
+    else
+        return false;
+    mark_changed(prim);
+    return true;
+}
+
+void bvh_updater::mark_changed(hittable *prim) {
+    auto slot = slot_of.find(prim);
+    if (slot == slot_of.end())
+        return;
+    changed_leaves.push_back(leaf_of[slot->second]);
+    changed++;
+}
+
+void bvh_updater::set_shutter(float t0, float t1) {
+    time0 = t0;
+    time1 = t1;
+    for (size_t i = 0; i < moving.size(); i++)
+        mark_changed(moving[i]);
+}
+
+// New bounds and cost from the primitives of a leaf or the children of an
+// interior node, which are already up to date
+void bvh_updater::refit(int id) {
+    node_info &info = nodes[id];
+    bvh_node *node = info.node;
+    if (node->n_prims > 0) {
+        aabb box = empty_box();
+        for (int i = 0; i < node->n_prims; i++) {
+            aabb b;
+            if (node->prims[i]->bounding_box(time0, time1, b))
+                box = surrounding_box(box, b);
+        }
+        node->box = box;
+        return;
+    }
+    bvh_node *left = static_cast<bvh_node*>(node->left);
+    bvh_node *right = static_cast<bvh_node*>(node->right);
+    node->box = surrounding_box(left->box, right->box);
+    float area = node->box.area();
+    info.cost = sah_traversal_cost + (area > 0 ?
+        (left->box.area() * nodes[left->id].cost + right->box.area() * nodes[right->id].cost) / area : 0);
+}
+
+// The old nodes below are left behind in memory and their ids are not
+// reused. The node itself keeps its place, so its parent needs no change
+void bvh_updater::rebuild(int id) {
+    node_info info = nodes[id];
+    for (int i = info.first; i < info.first + info.count; i++)
+        slot_of.erase(list[i]);
+    info.node->rebuild(list + info.first, info.count, time0, time1, memory);
+    for (int i = info.first; i < info.first + info.count; i++)
+        slot_of[list[i]] = i;
+    index(info.node, info.parent, info.depth, id);
+}
+
+bvh_update_stats bvh_updater::update(float rebuild_threshold) {
+    bvh_update_stats stats;
+    stats.changed = changed;
+    stats.refitted = stats.rebuilt = stats.rebuilt_prims = 0;
+    stats.rebuild_ms = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    // The changed leaves and their ancestors, by depth. A path stops at
+    // the first node another path already marked
+    std::vector<std::vector<int>> levels;
+    for (size_t k = 0; k < changed_leaves.size(); k++) {
+        for (int id = changed_leaves[k]; id >= 0 && !nodes[id].dirty; id = nodes[id].parent) {
+            nodes[id].dirty = true;
+            if (nodes[id].depth >= int(levels.size()))
+                levels.resize(nodes[id].depth + 1);
+            levels[nodes[id].depth].push_back(id);
+        }
+    }
+    changed_leaves.clear();
+    changed = 0;
+
+    for (int depth = int(levels.size()) - 1; depth >= 0; depth--) {
+        const std::vector<int> &level = levels[depth];
+        int n = int(level.size());
+        parallel_chunks(n, chunk_count(n, build_thread_count(), refit_min_chunk), [&](int, int from, int to) {
+            for (int k = from; k < to; k++)
+                refit(level[k]);
+        });
+        stats.refitted += n;
+    }
+    stats.refit_ms = ms_since(start);
+
+    // Then the highest refitted nodes that got too slow are built again.
+    // The nodes below one are replaced with it, so going down the levels
+    // their dirty marks are cleared and they are passed over
+    for (size_t depth = 0; depth < levels.size(); depth++) {
+        for (size_t k = 0; k < levels[depth].size(); k++) {
+            int id = levels[depth][k];
+            node_info &info = nodes[id];
+            bool replaced = !info.dirty;
+            info.dirty = false;
+            bvh_node *node = info.node;
+            if (node->n_prims > 0)
+                continue;
+            if (!replaced && info.cost <= rebuild_threshold * info.built_cost)
+                continue;
+            nodes[static_cast<bvh_node*>(node->left)->id].dirty = false;
+            nodes[static_cast<bvh_node*>(node->right)->id].dirty = false;
+            if (replaced)
+                continue;
+
+            auto rebuild_start = std::chrono::steady_clock::now();
+            stats.rebuilt++;
+            stats.rebuilt_prims += info.count;
+            int parent = info.parent;
+            rebuild(id);
+            // The ancestors' costs change with the new subtree's
+            for (int a = parent; a >= 0; a = nodes[a].parent)
+                refit(a);
+            stats.rebuild_ms += ms_since(rebuild_start);
+        }
+    }
+    stats.sah_cost = nodes[root->id].cost;
+    stats.built_sah_cost = nodes[root->id].built_cost;
+    return stats;
+}
+
+#endif
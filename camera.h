@@ -2,11 +2,18 @@
 #define CAMERAH
 
 #include "ray.h"
+#include "random.h"
+#include "packet.h"
 
-vec3 random_in_unit_disk(){
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define CAMERA_SSE 1
+#endif
+
+vec3 random_in_unit_disk(rng &random){
     vec3 p;
     do {
-        p = 2.0 * vec3(drand48(), drand48(), 0) - vec3(1, 1, 0);
+        p = 2.0 * vec3(random.next_float(), random.next_float(), 0) - vec3(1, 1, 0);
     } while (dot(p, p) >= 1.0);
     return p;
 }
@@ -42,16 +49,57 @@ public:
         horizontal = 2 * half_width * focus_dist*u;
         vertical = 2 * half_height * focus_dist*v;
     }
-    ray get_ray(float s, float t) {
-        vec3 rd = lens_radius*random_in_unit_disk();
+    ray get_ray(float s, float t, rng &random) {
+        vec3 rd = lens_radius*random_in_unit_disk(random);
         vec3 offset = u * rd.x() + v * rd.y();
-        float time = time0 + drand48()*(time1-time0);
+        float time = time0 + random.next_float()*(time1-time0);
         return ray(
             origin + offset,
             lower_left_corner + s*horizontal + t*vertical - origin - offset,
             time);
     }
 
+    // The same rays get_ray(s[k], t[k], random[k]) returns, for n pixels at
+    // once. The lens and shutter samples draw from each ray's own stream,
+    // the directions are computed four at a time with the same operations
+    // in the same order, so packets and single rays give identical images.
+    // s and t hold packet_size entries, lanes past n are computed and dropped
+    void get_packet(const float *s, const float *t, rng *random, int n, ray *rays) {
+        float off[3][packet_size] = {};
+        float time[packet_size];
+        for (int k = 0; k < n; k++) {
+            vec3 rd = lens_radius*random_in_unit_disk(random[k]);
+            vec3 offset = u * rd.x() + v * rd.y();
+            for (int a = 0; a < 3; a++)
+                off[a][k] = offset[a];
+            time[k] = time0 + random[k].next_float()*(time1-time0);
+        }
+
+        float dir[3][packet_size];
+#ifdef CAMERA_SSE
+        for (int k = 0; k < n; k += 4) {
+            __m128 vs = _mm_loadu_ps(&s[k]);
+            __m128 vt = _mm_loadu_ps(&t[k]);
+            for (int a = 0; a < 3; a++) {
+                __m128 d = _mm_add_ps(_mm_set1_ps(lower_left_corner[a]), _mm_mul_ps(vs, _mm_set1_ps(horizontal[a])));
+                d = _mm_add_ps(d, _mm_mul_ps(vt, _mm_set1_ps(vertical[a])));
+                d = _mm_sub_ps(d, _mm_set1_ps(origin[a]));
+                d = _mm_sub_ps(d, _mm_loadu_ps(&off[a][k]));
+                _mm_storeu_ps(&dir[a][k], d);
+            }
+        }
+#else
+        for (int k = 0; k < n; k++) {
+            for (int a = 0; a < 3; a++)
+                dir[a][k] = lower_left_corner[a] + s[k]*horizontal[a] + t[k]*vertical[a] - origin[a] - off[a][k];
+        }
+#endif
+        for (int k = 0; k < n; k++) {
+            vec3 offset(off[0][k], off[1][k], off[2][k]);
+            rays[k] = ray(origin + offset, vec3(dir[0][k], dir[1][k], dir[2][k]), time[k]);
+        }
+    }
+
     vec3 origin;
     vec3 lower_left_corner;
     vec3 horizontal;
@@ -0,0 +1,404 @@
+#ifndef COMPILEDSCENEH
+#define COMPILEDSCENEH
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "texture.h"
+#include "scene.h"
+
+// A compiled scene is a scene with its BVH already built, in one binary
+// file that is mapped into memory and traced in place: the nodes of the
+// linear BVH and the packed sphere arrays are used where they lie in the
+// mapping. Every section is found from an offset in the header, so the
+// file does not depend on where it is mapped.
+// Materials and textures have virtual functions and cannot be mapped, so
+// they are stored as small records and made in the scene arena on load.
+// Numbers are in native byte order; the file is a cache, not a format to
+// move between machines
+//
+// Layout: header, then 64 byte aligned sections:
+//   nodes       n_nodes linear_bvh_nodes
+//   spheres     10 arrays of n_slots floats (cx cy cz delta_x delta_y
+//               delta_z time0 inv_dt radius) and ints (mat)
+//   textures    n_textures compiled_texture records
+//   materials   n_materials compiled_material records
+const char compiled_scene_magic[8] = { 'r', 't', 's', 'c', 'e', 'n', 'e', '\n' };
+const uint32_t compiled_scene_version = 2;
+const int compiled_sphere_arrays = 10;
+
+enum compiled_texture_kind { compiled_constant, compiled_checker, compiled_noise, compiled_plane_checker };
+
+// A checker refers to the two textures before it by index. A plane
+// checker keeps the side of its squares in scale
+struct compiled_texture {
+    int32_t kind;
+    int32_t even, odd;
+    float color[3];
+    float scale;
+};
+
+struct compiled_material {
+    int32_t kind;
+    int32_t texture;
+    float albedo[3];
+    float fuzz;
+    float ref_idx;
+};
+
+struct compiled_scene_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // Identifies the source scene and the settings the BVH was built with
+    uint64_t key;
+    // lookfrom, lookat, vup, vfov, aperture, focus_dist, time0, time1
+    float view[14];
+    int32_t nx, ny, ns;
+    int32_t n_nodes, n_slots, n_spheres, n_textures, n_materials;
+    uint64_t nodes;
+    uint64_t spheres[compiled_sphere_arrays];
+    uint64_t textures;
+    uint64_t materials;
+    uint64_t size;
+};
+
+// The key of the compiled form of a source scene. Anything that changes
+// the tree or the file layout changes the key, so an old cache is rebuilt
+uint64_t compiled_scene_key(uint64_t source_hash) {
+    uint64_t key = mix_seed(source_hash ^ compiled_scene_version);
+    key = mix_seed(key ^ uint64_t(sizeof(compiled_scene_header)));
+    key = mix_seed(key ^ uint64_t(sphere_leaf_size));
+    key = mix_seed(key ^ uint64_t(sah_bins));
+    return key;
+}
+
+void pack_view(const camera_settings &v, float *out) {
+    const vec3 *vectors[3] = { &v.lookfrom, &v.lookat, &v.vup };
+    for (int i = 0; i < 3; i++) {
+        for (int c = 0; c < 3; c++)
+            out[3*i + c] = (*vectors[i])[c];
+    }
+    out[9] = v.vfov;
+    out[10] = v.aperture;
+    out[11] = v.focus_dist;
+    out[12] = v.time0;
+    out[13] = v.time1;
+}
+
+camera_settings unpack_view(const float *in) {
+    camera_settings v;
+    v.lookfrom = vec3(in[0], in[1], in[2]);
+    v.lookat = vec3(in[3], in[4], in[5]);
+    v.vup = vec3(in[6], in[7], in[8]);
+    v.vfov = in[9];
+    v.aperture = in[10];
+    v.focus_dist = in[11];
+    v.time0 = in[12];
+    v.time1 = in[13];
+    return v;
+}
+
+// Gives every texture reachable from the materials an index, with the
+// even and odd textures of a checker before the checker itself. complete
+// is false once a texture the format cannot store was met
+class texture_table {
+    public:
+        int add(texture *t) {
+            auto found = index.find(t);
+            if (found != index.end())
+                return found->second;
+            compiled_texture c = {};
+            if (constant_texture *k = dynamic_cast<constant_texture*>(t)) {
+                c.kind = compiled_constant;
+                for (int i = 0; i < 3; i++)
+                    c.color[i] = k->color[i];
+            }
+            else if (checker_texture *k = dynamic_cast<checker_texture*>(t)) {
+                c.kind = compiled_checker;
+                c.even = add(k->even);
+                c.odd = add(k->odd);
+            }
+            else if (plane_checker_texture *k = dynamic_cast<plane_checker_texture*>(t)) {
+                c.kind = compiled_plane_checker;
+                c.even = add(k->even);
+                c.odd = add(k->odd);
+                c.scale = k->size;
+            }
+            else if (noise_texture *k = dynamic_cast<noise_texture*>(t)) {
+                c.kind = compiled_noise;
+                c.scale = k->scale;
+            }
+            else {
+                fprintf(stderr, "cannot compile an unknown texture\n");
+                complete = false;
+                c.kind = compiled_constant;
+            }
+            int i = int(records.size());
+            records.push_back(c);
+            index[t] = i;
+            return i;
+        }
+
+        std::vector<compiled_texture> records;
+        bool complete = true;
+
+    private:
+        std::unordered_map<texture*, int> index;
+};
+
+size_t align_section(size_t offset) {
+    return (offset + 63) & ~size_t(63);
+}
+
+// Write bytes at offset, padding the file with zeros up to it
+bool write_section(FILE *f, size_t &position, size_t offset, const void *data, size_t bytes) {
+    static const char zeros[64] = {};
+    if (fwrite(zeros, 1, offset - position, f) != offset - position)
+        return false;
+    position = offset + bytes;
+    return bytes == 0 || fwrite(data, 1, bytes, f) == bytes;
+}
+
+// Write the compiled form of a scene whose BVH is bvh. Only trees made
+// entirely of packed sphere leaves, with textures the format knows, can
+// be compiled
+bool write_compiled_scene(const char *path, uint64_t key, const scene_description &s, const linear_bvh &bvh) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < bvh.tree_size; i++) {
+        if (bvh.tree[i].n_prims > 0 && !(bvh.tree[i].flags & linear_bvh_sphere_leaf)) {
+            fprintf(stderr, "only scenes made of spheres can be compiled\n");
+            return false;
+        }
+    }
+
+    const sphere_soa &spheres = bvh.spheres;
+    texture_table textures;
+    std::vector<compiled_material> materials(spheres.materials.size());
+    for (size_t i = 0; i < materials.size(); i++) {
+        material *m = spheres.materials[i];
+        compiled_material &c = materials[i];
+        c = compiled_material();
+        c.kind = m->kind;
+        if (lambertian *l = dynamic_cast<lambertian*>(m))
+            c.texture = textures.add(l->albedo);
+        else if (metal *mt = dynamic_cast<metal*>(m)) {
+            for (int k = 0; k < 3; k++)
+                c.albedo[k] = mt->albedo[k];
+            c.fuzz = mt->fuzz;
+        }
+        else if (dielectric *d = dynamic_cast<dielectric*>(m))
+            c.ref_idx = d->ref_idx;
+    }
+    if (!textures.complete)
+        return false;
+
+    const float *arrays[compiled_sphere_arrays - 1] = {
+        spheres.arrays.cx, spheres.arrays.cy, spheres.arrays.cz,
+        spheres.arrays.delta_x, spheres.arrays.delta_y, spheres.arrays.delta_z,
+        spheres.arrays.time0, spheres.arrays.inv_dt, spheres.arrays.radius
+    };
+    int n_slots = int(spheres.cx.size());
+
+    compiled_scene_header h = {};
+    memcpy(h.magic, compiled_scene_magic, sizeof(h.magic));
+    h.version = compiled_scene_version;
+    h.header_size = sizeof(h);
+    h.key = key;
+    pack_view(s.view, h.view);
+    h.nx = s.nx;
+    h.ny = s.ny;
+    h.ns = s.ns;
+    h.n_nodes = bvh.tree_size;
+    h.n_slots = n_slots;
+    h.n_spheres = spheres.size();
+    h.n_textures = int(textures.records.size());
+    h.n_materials = int(materials.size());
+    size_t offset = align_section(sizeof(h));
+    h.nodes = offset;
+    offset = align_section(offset + size_t(h.n_nodes) * sizeof(linear_bvh_node));
+    for (int a = 0; a < compiled_sphere_arrays; a++) {
+        h.spheres[a] = offset;
+        offset = align_section(offset + size_t(n_slots) * 4);
+    }
+    h.textures = offset;
+    offset = align_section(offset + textures.records.size() * sizeof(compiled_texture));
+    h.materials = offset;
+    h.size = offset + materials.size() * sizeof(compiled_material);
+
+    // Written next to path and renamed over it, so a reader never maps a
+    // half written file
+    std::string temp = std::string(path) + ".tmp";
+    FILE *f = fopen(temp.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "cannot write compiled scene %s\n", temp.c_str());
+        return false;
+    }
+    size_t position = 0;
+    bool ok = write_section(f, position, 0, &h, sizeof(h)) &&
+              write_section(f, position, h.nodes, bvh.tree, size_t(h.n_nodes) * sizeof(linear_bvh_node));
+    for (int a = 0; a < compiled_sphere_arrays - 1 && ok; a++)
+        ok = write_section(f, position, h.spheres[a], arrays[a], size_t(n_slots) * 4);
+    ok = ok && write_section(f, position, h.spheres[compiled_sphere_arrays - 1], spheres.arrays.mat,
+                             size_t(n_slots) * 4) &&
+         write_section(f, position, h.textures, textures.records.data(),
+                       textures.records.size() * sizeof(compiled_texture)) &&
+         write_section(f, position, h.materials, materials.data(), materials.size() * sizeof(compiled_material));
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path) != 0) {
+        fprintf(stderr, "cannot write compiled scene %s\n", path);
+        remove(temp.c_str());
+        return false;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Wrote compiled scene %s, %.1f MB in %.1f ms\n", path, h.size / 1048576.0, ms);
+    return true;
+}
+
+// A compiled scene mapped into memory. The mapping lives as long as the
+// object, and so must the BVH traced from it. The BVH and materials are
+// made in the arena given to map()
+class compiled_scene {
+    public:
+        compiled_scene() : data(nullptr), size(0), bvh(nullptr) {}
+        ~compiled_scene() {
+            if (data)
+                munmap(data, size);
+        }
+
+        // Map path and make its materials in memory. Fails if there is no
+        // such file, or if it is not a compiled scene with this key
+        bool map(const char *path, uint64_t key, arena &memory);
+
+        scene_description description;
+        void *data;
+        size_t size;
+        linear_bvh *bvh;
+
+    private:
+        compiled_scene(const compiled_scene&);
+        compiled_scene &operator=(const compiled_scene&);
+
+        bool make_materials(const compiled_scene_header &h, arena &memory, material **&table);
+};
+
+bool compiled_scene::make_materials(const compiled_scene_header &h, arena &memory, material **&table) {
+    const char *base = static_cast<const char*>(data);
+    const compiled_texture *tex = reinterpret_cast<const compiled_texture*>(base + h.textures);
+    const compiled_material *mats = reinterpret_cast<const compiled_material*>(base + h.materials);
+
+    texture **textures = memory.make_array<texture*>(h.n_textures, list_memory);
+    for (int i = 0; i < h.n_textures; i++) {
+        const compiled_texture &c = tex[i];
+        if (c.kind == compiled_constant)
+            textures[i] = memory.make<constant_texture>(texture_memory, vec3(c.color[0], c.color[1], c.color[2]));
+        else if (c.kind == compiled_checker && c.even >= 0 && c.even < i && c.odd >= 0 && c.odd < i)
+            textures[i] = memory.make<checker_texture>(texture_memory, textures[c.even], textures[c.odd]);
+        else if (c.kind == compiled_plane_checker && c.even >= 0 && c.even < i && c.odd >= 0 && c.odd < i &&
+                 c.scale > 0)
+            textures[i] = memory.make<plane_checker_texture>(texture_memory, textures[c.even], textures[c.odd],
+                                                             c.scale);
+        else if (c.kind == compiled_noise)
+            textures[i] = memory.make<noise_texture>(texture_memory, c.scale);
+        else
+            return false;
+    }
+
+    table = memory.make_array<material*>(h.n_materials, list_memory);
+    for (int i = 0; i < h.n_materials; i++) {
+        const compiled_material &c = mats[i];
+        if (c.kind == lambertian_kind && c.texture >= 0 && c.texture < h.n_textures)
+            table[i] = memory.make<lambertian>(material_memory, textures[c.texture]);
+        else if (c.kind == metal_kind)
+            table[i] = memory.make<metal>(material_memory, vec3(c.albedo[0], c.albedo[1], c.albedo[2]), c.fuzz);
+        else if (c.kind == dielectric_kind)
+            table[i] = memory.make<dielectric>(material_memory, c.ref_idx);
+        else
+            return false;
+    }
+    return true;
+}
+
+bool compiled_scene::map(const char *path, uint64_t key, arena &memory) {
+    auto start = std::chrono::steady_clock::now();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(compiled_scene_header)) {
+        close(fd);
+        fprintf(stderr, "%s is not a compiled scene\n", path);
+        return false;
+    }
+    size = st.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        data = nullptr;
+        fprintf(stderr, "cannot map %s\n", path);
+        return false;
+    }
+
+    const char *base = static_cast<const char*>(data);
+    const compiled_scene_header &h = *reinterpret_cast<const compiled_scene_header*>(base);
+    bool ok = memcmp(h.magic, compiled_scene_magic, sizeof(h.magic)) == 0 &&
+              h.version == compiled_scene_version && h.header_size == sizeof(h) && h.size == size &&
+              h.n_nodes > 0 && h.n_slots >= h.n_spheres + 3 && h.n_textures >= 0 && h.n_materials >= 0 &&
+              h.nodes + size_t(h.n_nodes) * sizeof(linear_bvh_node) <= size &&
+              h.textures + size_t(h.n_textures) * sizeof(compiled_texture) <= size &&
+              h.materials + size_t(h.n_materials) * sizeof(compiled_material) <= size;
+    for (int a = 0; a < compiled_sphere_arrays && ok; a++)
+        ok = h.spheres[a] % 4 == 0 && h.spheres[a] + size_t(h.n_slots) * 4 <= size;
+    material **materials = nullptr;
+    if (ok && h.key != key)
+        fprintf(stderr, "compiled scene %s is stale, rebuilding it\n", path);
+    else if (!ok || !make_materials(h, memory, materials))
+        fprintf(stderr, "%s is not a compiled scene, rebuilding it\n", path);
+    if (!ok || h.key != key || !materials) {
+        munmap(data, size);
+        data = nullptr;
+        return false;
+    }
+
+    sphere_soa_arrays arrays;
+    const float *f[compiled_sphere_arrays - 1];
+    for (int a = 0; a < compiled_sphere_arrays - 1; a++)
+        f[a] = reinterpret_cast<const float*>(base + h.spheres[a]);
+    arrays.cx = f[0];
+    arrays.cy = f[1];
+    arrays.cz = f[2];
+    arrays.delta_x = f[3];
+    arrays.delta_y = f[4];
+    arrays.delta_z = f[5];
+    arrays.time0 = f[6];
+    arrays.inv_dt = f[7];
+    arrays.radius = f[8];
+    arrays.mat = reinterpret_cast<const int*>(base + h.spheres[compiled_sphere_arrays - 1]);
+    arrays.materials = materials;
+    // The tree itself owns no memory, its arrays are in the mapping
+    bvh = memory.make<linear_bvh>(accel_memory, reinterpret_cast<const linear_bvh_node*>(base + h.nodes),
+                                  int(h.n_nodes), arrays, int(h.n_spheres));
+    bvh->stats.primitives = h.n_spheres;
+
+    description.view = unpack_view(h.view);
+    description.nx = h.nx;
+    description.ny = h.ny;
+    description.ns = h.ns;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Mapped compiled scene %s: %d spheres, %d nodes, %.1f MB in %.2f ms\n",
+            path, h.n_spheres, h.n_nodes, size / 1048576.0, ms);
+    return true;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef FRAMEBUFFERH
+#define FRAMEBUFFERH
+
+#include <vector>
+#include "vec3.h"
+
+// Linear colors for a nx by ny image, and the number of samples each pixel
+// took. Row 0 is the bottom of the image, matching the v coordinate passed
+// to the camera. A framebuffer can also hold a horizontal strip of a
+// larger image, rows y0 to y0 + ny, and is then indexed with the rows of
+// the whole image.
+// Workers write disjoint tiles, so no locking is needed
+class framebuffer {
+    public:
+        framebuffer(int x, int y, int first_row = 0)
+            : nx(x), ny(y), y0(first_row), pixels(x*y, vec3(0, 0, 0)), samples(x*y, 0) {}
+
+        vec3& at(int i, int j) { return pixels[(j - y0)*nx + i]; }
+        const vec3& at(int i, int j) const { return pixels[(j - y0)*nx + i]; }
+        int& samples_at(int i, int j) { return samples[(j - y0)*nx + i]; }
+
+        int nx, ny;
+        int y0;
+        std::vector<vec3> pixels;
+        std::vector<int> samples;
+};
+
+#endif
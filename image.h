@@ -0,0 +1,246 @@
+#ifndef IMAGEH
+#define IMAGEH
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <stdint.h>
+#include "framebuffer.h"
+
+// Images are encoded into one buffer in memory and written with a single
+// fwrite. The format follows the extension of the path:
+//   .ppm  binary P6, gamma corrected 8 bit RGB
+//   .pfm  linear float RGB, no gamma and no clamping
+//   .qoi  the Quite OK Image format, lossless 8 bit RGB that is smaller
+//         than a ppm and about as fast to write
+
+// 8 bit RGB rows from the top of the image (or strip) down, gamma
+// corrected with gamma 2 and clamped to 255
+std::vector<uint8_t> rgb8(const framebuffer &fb) {
+    std::vector<uint8_t> rgb(size_t(fb.nx) * fb.ny * 3);
+    uint8_t *out = rgb.data();
+    for (int j = fb.ny-1; j >= 0; j--) {
+        for (int i = 0; i < fb.nx; i++) {
+            const vec3 &col = fb.pixels[size_t(j)*fb.nx + i];
+            for (int c = 0; c < 3; c++) {
+                int v = int(255.99*sqrt(col[c]));
+                *out++ = uint8_t(v < 0 ? 0 : v > 255 ? 255 : v);
+            }
+        }
+    }
+    return rgb;
+}
+
+// P6 is P3 with the RGB triplets stored as bytes instead of ASCII numbers
+std::vector<uint8_t> ppm_header(int nx, int ny) {
+    char header[64];
+    int n = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", nx, ny);
+    return std::vector<uint8_t>(header, header + n);
+}
+
+std::vector<uint8_t> encode_ppm(int nx, int ny, const std::vector<uint8_t> &rgb) {
+    std::vector<uint8_t> out = ppm_header(nx, ny);
+    out.insert(out.end(), rgb.begin(), rgb.end());
+    return out;
+}
+
+// PFM stores rows from the bottom up, like the framebuffer. A negative
+// scale marks little endian floats
+std::vector<uint8_t> pfm_header(int nx, int ny) {
+    char header[64];
+    int n = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", nx, ny);
+    return std::vector<uint8_t>(header, header + n);
+}
+
+// Append the pixels of fb as PFM rows
+void append_pfm_rows(const framebuffer &fb, std::vector<uint8_t> &out) {
+    size_t n = out.size();
+    out.resize(n + fb.pixels.size() * 3 * sizeof(float));
+    uint8_t *data = out.data() + n;
+    for (size_t p = 0; p < fb.pixels.size(); p++) {
+        float col[3] = { fb.pixels[p].x(), fb.pixels[p].y(), fb.pixels[p].z() };
+        for (int c = 0; c < 3; c++) {
+            uint32_t bits;
+            memcpy(&bits, &col[c], 4);
+            for (int b = 0; b < 4; b++)
+                *data++ = uint8_t(bits >> (8*b));
+        }
+    }
+}
+
+std::vector<uint8_t> encode_pfm(const framebuffer &fb) {
+    std::vector<uint8_t> out = pfm_header(fb.nx, fb.ny);
+    append_pfm_rows(fb, out);
+    return out;
+}
+
+// QOI encodes each pixel as a run of the previous pixel, an index into a
+// 64 entry table of recently seen colors, a small difference from the
+// previous pixel, or the full color
+std::vector<uint8_t> encode_qoi(int nx, int ny, const std::vector<uint8_t> &rgb) {
+    std::vector<uint8_t> out;
+    out.reserve(14 + rgb.size() + rgb.size() / 3 + 8);
+    const uint8_t magic[4] = { 'q', 'o', 'i', 'f' };
+    out.insert(out.end(), magic, magic + 4);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(uint8_t(uint32_t(nx) >> shift));
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(uint8_t(uint32_t(ny) >> shift));
+    out.push_back(3);    // channels
+    out.push_back(0);    // colorspace
+
+    uint8_t seen[64][3] = {};
+    bool seen_used[64] = {};
+    int pr = 0, pg = 0, pb = 0;
+    int run = 0;
+    size_t n = rgb.size() / 3;
+    for (size_t p = 0; p < n; p++) {
+        int r = rgb[3*p], g = rgb[3*p+1], b = rgb[3*p+2];
+        if (r == pr && g == pg && b == pb) {
+            run++;
+            if (run == 62 || p == n - 1) {
+                out.push_back(uint8_t(0xc0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back(uint8_t(0xc0 | (run - 1)));
+            run = 0;
+        }
+
+        // Alpha is always 255
+        int index = (r*3 + g*5 + b*7 + 255*11) % 64;
+        if (seen_used[index] && seen[index][0] == r && seen[index][1] == g && seen[index][2] == b)
+            out.push_back(uint8_t(index));
+        else {
+            seen_used[index] = true;
+            seen[index][0] = r;
+            seen[index][1] = g;
+            seen[index][2] = b;
+            int dr = int8_t(r - pr), dg = int8_t(g - pg), db = int8_t(b - pb);
+            int dr_dg = dr - dg, db_dg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                out.push_back(uint8_t(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                out.push_back(uint8_t(0x80 | (dg + 32)));
+                out.push_back(uint8_t((dr_dg + 8) << 4 | (db_dg + 8)));
+            }
+            else {
+                out.push_back(0xfe);
+                out.push_back(uint8_t(r));
+                out.push_back(uint8_t(g));
+                out.push_back(uint8_t(b));
+            }
+        }
+        pr = r;
+        pg = g;
+        pb = b;
+    }
+    const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    out.insert(out.end(), end, end + 8);
+    return out;
+}
+
+bool has_extension(const char *path, const char *ext) {
+    size_t n = strlen(path), e = strlen(ext);
+    return n >= e && strcmp(path + n - e, ext) == 0;
+}
+
+bool write_file(const char *path, const std::vector<uint8_t> &data) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "cannot write %s\n", path);
+    return ok;
+}
+
+bool supported_image(const char *path) {
+    return has_extension(path, ".ppm") || has_extension(path, ".pfm") || has_extension(path, ".qoi");
+}
+
+// Encode fb in the format given by the extension of path and write it
+bool write_image(const char *path, const framebuffer &fb) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> data;
+    if (has_extension(path, ".pfm"))
+        data = encode_pfm(fb);
+    else if (has_extension(path, ".qoi"))
+        data = encode_qoi(fb.nx, fb.ny, rgb8(fb));
+    else if (has_extension(path, ".ppm"))
+        data = encode_ppm(fb.nx, fb.ny, rgb8(fb));
+    else {
+        fprintf(stderr, "unknown image format %s\n", path);
+        return false;
+    }
+    if (!write_file(path, data))
+        return false;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Wrote %s, %.1f KB in %.1f ms\n", path, data.size() / 1024.0, ms);
+    return true;
+}
+
+// Where the samples map of an image goes: next to it, with _samples
+// added to its stem, always as a ppm
+std::string samples_path(const char *output) {
+    const char *dot = strrchr(output, '.');
+    const char *slash = strrchr(output, '/');
+    int stem = dot && dot > (slash ? slash : output) ? int(dot - output) : int(strlen(output));
+    return std::string(output, stem) + "_samples.ppm";
+}
+
+// The samples each pixel took as a grey level, white for max_samples
+bool write_samples_ppm(const char *path, const framebuffer &fb, int max_samples) {
+    std::vector<uint8_t> rgb;
+    rgb.reserve(size_t(fb.nx) * fb.ny * 3);
+    for (int j = fb.ny-1; j >= 0; j--) {
+        for (int i = 0; i < fb.nx; i++) {
+            int level = int(255.99 * fb.samples[size_t(j)*fb.nx + i] / max_samples);
+            level = level > 255 ? 255 : level;
+            rgb.insert(rgb.end(), 3, uint8_t(level));
+        }
+    }
+    return write_file(path, encode_ppm(fb.nx, fb.ny, rgb));
+}
+
+// Writes images on a background thread so rendering can go on meanwhile.
+// The framebuffer is copied, and a write waits for the one before it
+class image_writer {
+    public:
+        ~image_writer() { wait(); }
+
+        void write(const char *path, const framebuffer &fb) {
+            wait();
+            copy.reset(new framebuffer(fb));
+            target = path;
+            thread = std::thread([this]() { written = write_image(target.c_str(), *copy); });
+        }
+
+        // Waits for the last write. False if any write so far failed
+        bool wait() {
+            if (thread.joinable()) {
+                thread.join();
+                failed = failed || !written;
+            }
+            return !failed;
+        }
+
+    private:
+        std::thread thread;
+        bool written = true;
+        bool failed = false;
+        std::unique_ptr<framebuffer> copy;
+        std::string target;
+};
+
+#endif
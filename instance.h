@@ -0,0 +1,158 @@
+#ifndef INSTANCEH
+#define INSTANCEH
+
+#include <cmath>
+#include "hittable.h"
+#include "aabb.h"
+
+// An affine transform, a 3x3 linear part and a translation in the last
+// column: p' = m p + t
+class transform {
+    public:
+        transform() {
+            for (int r = 0; r < 3; r++) {
+                for (int c = 0; c < 4; c++)
+                    m[r][c] = r == c ? 1 : 0;
+            }
+        }
+
+        vec3 point(const vec3 &p) const {
+            return vec3(m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+                        m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+                        m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+        }
+        vec3 vector(const vec3 &v) const {
+            return vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+                        m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+                        m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+        }
+        // The linear part transposed times v. With the inverse transform,
+        // this takes normals from object to world space
+        vec3 transposed_vector(const vec3 &v) const {
+            return vec3(m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+                        m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+                        m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+        }
+
+        // Returns false for a transform that flattens space
+        bool inverse(transform &inv) const;
+
+        float m[3][4];
+};
+
+// a after b: (a * b).point(p) == a.point(b.point(p))
+transform operator*(const transform &a, const transform &b) {
+    transform t;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            t.m[r][c] = a.m[r][0]*b.m[0][c] + a.m[r][1]*b.m[1][c] + a.m[r][2]*b.m[2][c];
+            if (c == 3)
+                t.m[r][c] += a.m[r][3];
+        }
+    }
+    return t;
+}
+
+bool transform::inverse(transform &inv) const {
+    // The inverse of the linear part from its cofactors
+    float c[3][3];
+    for (int r = 0; r < 3; r++) {
+        for (int k = 0; k < 3; k++) {
+            int r1 = (r + 1) % 3, r2 = (r + 2) % 3, k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+            c[k][r] = m[r1][k1]*m[r2][k2] - m[r1][k2]*m[r2][k1];
+        }
+    }
+    float det = m[0][0]*c[0][0] + m[0][1]*c[1][0] + m[0][2]*c[2][0];
+    if (det == 0 || !std::isfinite(det))
+        return false;
+    for (int r = 0; r < 3; r++) {
+        for (int k = 0; k < 3; k++)
+            inv.m[r][k] = c[r][k] / det;
+    }
+    // Then the translation is undone in the new frame
+    for (int r = 0; r < 3; r++)
+        inv.m[r][3] = -(inv.m[r][0]*m[0][3] + inv.m[r][1]*m[1][3] + inv.m[r][2]*m[2][3]);
+    return true;
+}
+
+transform translation(const vec3 &d) {
+    transform t;
+    for (int r = 0; r < 3; r++)
+        t.m[r][3] = d[r];
+    return t;
+}
+
+transform scaling(const vec3 &s) {
+    transform t;
+    for (int r = 0; r < 3; r++)
+        t.m[r][r] = s[r];
+    return t;
+}
+
+// A rotation by degrees about axis, counter clockwise looking down the
+// axis towards the origin
+transform rotation(const vec3 &axis, float degrees) {
+    vec3 a = unit_vector(axis);
+    float theta = degrees * float(M_PI) / 180;
+    float s = sin(theta), c = cos(theta), k = 1 - c;
+    transform t;
+    t.m[0][0] = a.x()*a.x()*k + c;
+    t.m[0][1] = a.x()*a.y()*k - a.z()*s;
+    t.m[0][2] = a.x()*a.z()*k + a.y()*s;
+    t.m[1][0] = a.y()*a.x()*k + a.z()*s;
+    t.m[1][1] = a.y()*a.y()*k + c;
+    t.m[1][2] = a.y()*a.z()*k - a.x()*s;
+    t.m[2][0] = a.z()*a.x()*k - a.y()*s;
+    t.m[2][1] = a.z()*a.y()*k + a.x()*s;
+    t.m[2][2] = a.z()*a.z()*k + c;
+    return t;
+}
+
+// A placed copy of a shared object. The object, usually a BVH over its
+// own primitives (the bottom level), is stored once however many
+// instances refer to it; an instance only holds the object pointer and
+// its transforms. Rays are moved into object space instead of moving the
+// object. The direction is not normalized, so t is the same in both
+// spaces. The scene's own BVH over the instances is the top level
+class instance : public hittable {
+    public:
+        // to_world must be invertible
+        instance(hittable *o, const transform &world) : object(o), to_world(world) {
+            to_world.inverse(to_object);
+        }
+
+        virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb &box) const;
+
+        hittable *object;
+        transform to_world;
+        transform to_object;
+};
+
+bool instance::hit(const ray &r, float t_min, float t_max, hit_record &rec) const {
+    ray local(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+    if (!object->hit(local, t_min, t_max, rec))
+        return false;
+    rec.p = r.point_at_parameter(rec.t);
+    // Normals go by the inverse transpose, so they stay perpendicular to
+    // surfaces under non uniform scaling
+    rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+    return true;
+}
+
+// The box around the eight transformed corners of the object's box
+bool instance::bounding_box(float t0, float t1, aabb &box) const {
+    aabb local;
+    if (!object->bounding_box(t0, t1, local))
+        return false;
+    box = empty_box();
+    for (int k = 0; k < 8; k++) {
+        vec3 corner((k & 1 ? local.max() : local.min()).x(),
+                    (k & 2 ? local.max() : local.min()).y(),
+                    (k & 4 ? local.max() : local.min()).z());
+        box = surrounding_box(box, to_world.point(corner));
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef INTEGRATORH
+#define INTEGRATORH
+
+#include "ray.h"
+#include "aabb.h"
+#include "random.h"
+#include "hittable.h"
+#include "material.h"
+
+// How far paths are followed. Paths are cut off after max_depth bounces.
+// From rr_depth bounces on, a path survives each bounce with a probability
+// given by its throughput and the survivors are weighted up to make up for
+// the ones that were dropped. rr_depth >= max_depth turns this off
+struct path_options {
+    int max_depth = 50;
+    int rr_depth = 5;
+};
+
+// Which integrator renders the image
+enum integrator_kind { recursive_kind, iterative_kind, wavefront_kind };
+
+// Rays traced by this thread since the last tile finished
+thread_local long long rays_traced = 0;
+
+// If a ray hits nothing, blend white and blue based on the ray's y coord
+vec3 sky(const ray& r) {
+    // Turn ray into a unit vector. This makes -1.0 < y < 1.0
+    vec3 unit_direction = unit_vector(r.direction());
+
+    // Scale ray to 0.0 < t < 1.0
+    float t = 0.5 * (unit_direction.y() + 1.0);
+
+    // Return a linear interpolation (lerp) between
+    // blue (t=1.0) and white (t=0.0)
+    return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+}
+
+// Decide whether a path that has made depth bounces goes on, and weight
+// its throughput if it does
+bool russian_roulette(vec3 &throughput, int depth, const path_options &options, rng &random) {
+    if (depth < options.rr_depth)
+        return true;
+    float survive = ffmin(ffmax(throughput.x(), ffmax(throughput.y(), throughput.z())), 1);
+    if (random.next_float() >= survive)
+        return false;
+    throughput /= survive;
+    return true;
+}
+
+vec3 color(const ray& r, hittable *world, int depth, const path_options &options, rng &random);
+
+// The color carried back along r, given whether and where it hit the world.
+// Primary rays traced as a packet come in here with their hits.
+// This recursive form has no Russian roulette and is kept as the reference
+vec3 shade(const ray& r, bool hit, const hit_record &rec, hittable *world, int depth,
+           const path_options &options, rng &random) {
+    rays_traced++;
+
+    if (hit) {
+        ray scattered;
+        vec3 attenuation;
+        if (depth < options.max_depth && rec.mat_ptr->scatter(r, rec, attenuation, scattered, random)) {
+             return attenuation * color(scattered, world, depth + 1, options, random);
+        }
+        else {
+            return vec3(0, 0 , 0);
+        }
+    }
+    else
+        return sky(r);
+}
+
+vec3 color(const ray& r, hittable *world, int depth, const path_options &options, rng &random) {
+    hit_record rec;
+    // Setting t_min to 0.001 (instead of 0) prevents shadow acne
+    bool hit = world->hit(r, 0.001, MAXFLOAT, rec);
+    return shade(r, hit, rec, world, depth, options, random);
+}
+
+// The same path as shade(), followed in a loop with the product of the
+// attenuations so far carried forward instead of multiplied on the way back
+vec3 trace_path(ray r, bool hit, hit_record rec, hittable *world, const path_options &options, rng &random) {
+    vec3 throughput(1, 1, 1);
+    for (int depth = 0; ; depth++) {
+        rays_traced++;
+        if (!hit)
+            return throughput * sky(r);
+
+        ray scattered;
+        vec3 attenuation;
+        if (depth >= options.max_depth || !rec.mat_ptr->scatter(r, rec, attenuation, scattered, random))
+            return vec3(0, 0, 0);
+        throughput *= attenuation;
+        if (!russian_roulette(throughput, depth + 1, options, random))
+            return vec3(0, 0, 0);
+
+        r = scattered;
+        hit = world->hit(r, 0.001, MAXFLOAT, rec);
+    }
+}
+
+vec3 trace_path(const ray& r, hittable *world, const path_options &options, rng &random) {
+    hit_record rec;
+    bool hit = world->hit(r, 0.001, MAXFLOAT, rec);
+    return trace_path(r, hit, rec, world, options, random);
+}
+
+#endif
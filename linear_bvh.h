@@ -0,0 +1,350 @@
+#ifndef LINEARBVHH
+#define LINEARBVHH
+
+#include <vector>
+#include <cassert>
+#include <stdint.h>
+#include "hittable.h"
+#include "bvh_build.h"
+#include "sphere_soa.h"
+#include "packet.h"
+
+// A BVH node packed into 32 bytes so two fit in a cache line.
+// Nodes are stored depth first: an interior node's first child directly
+// follows it and second_child holds the index of the other one.
+// Leaves test n_prims primitives starting at first_prim
+const uint8_t linear_bvh_sphere_leaf = 1;
+
+struct linear_bvh_node {
+    aabb box;
+    union {
+        int first_prim;
+        int second_child;
+    };
+    uint16_t n_prims;
+    uint8_t axis;
+    uint8_t flags;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+// Appends node and the tree below it to nodes, depth first, and returns
+// its index
+int flatten_bvh(const bvh_build_node *node, std::vector<linear_bvh_node> &nodes) {
+    int index = int(nodes.size());
+    nodes.push_back(linear_bvh_node());
+    nodes[index].box = node->box;
+    nodes[index].axis = uint8_t(node->split_axis);
+    nodes[index].flags = 0;
+    if (node->is_leaf()) {
+        assert(node->count <= UINT16_MAX);
+        nodes[index].first_prim = node->first;
+        nodes[index].n_prims = uint16_t(node->count);
+    }
+    else {
+        nodes[index].n_prims = 0;
+        flatten_bvh(node->children[0], nodes);
+        int second = flatten_bvh(node->children[1], nodes);
+        nodes[index].second_child = second;
+    }
+    return index;
+}
+
+// Walks a flattened tree for r, visiting the child on the side the ray
+// comes from first so that t_max shrinks early and the far child is often
+// culled. leaf(node, t_max) is called for every leaf whose box the ray
+// enters before t_max; it tests the leaf's primitives and lowers t_max to
+// the closest hit it finds
+template <class Leaf>
+void traverse_linear_bvh(const linear_bvh_node *tree, const ray &r, float t_min, float &t_max, Leaf leaf) {
+    box_ray br(r);
+    int stack[bvh_stack_size];
+    int stack_size = 0;
+    int current = 0;
+    for (;;) {
+        const linear_bvh_node &node = tree[current];
+        if (node.box.hit(br, t_min, t_max)) {
+            if (node.n_prims > 0) {
+                leaf(node, t_max);
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+            else if (br.sign[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.second_child;
+            }
+            else {
+                stack[stack_size++] = node.second_child;
+                current = current + 1;
+            }
+        }
+        else {
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+    }
+}
+
+// The SAH tree flattened into one contiguous array, traversed without
+// recursion or virtual calls on interior nodes
+class linear_bvh : public hittable {
+    public:
+        linear_bvh() {}
+        // Leaves made only of spheres are packed for the SIMD sphere
+        // kernel unless pack_spheres is false
+        linear_bvh(hittable **l, int n, float time0, float time1, bool pack_spheres = true);
+        // A tree made elsewhere, of sphere leaves only, traced in place
+        linear_bvh(const linear_bvh_node *n, int n_nodes, const sphere_soa_arrays &a, int slots);
+
+        virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb &box) const;
+
+        // Closest hits for a packet of coherent rays, walking the tree once
+        void hit_packet(const ray_packet &packet, float tmin, float tmax, packet_hits &hits) const;
+
+        std::vector<linear_bvh_node> nodes;
+        // The nodes traced: nodes, or the ones handed to the constructor
+        const linear_bvh_node *tree = nullptr;
+        int tree_size = 0;
+        // Primitives in leaf order
+        std::vector<hittable*> prims;
+        // The spheres among prims, in the same order. Leaves made only of
+        // spheres are flagged linear_bvh_sphere_leaf and tested from here
+        sphere_soa spheres;
+        bvh_stats stats;
+};
+
+linear_bvh::linear_bvh(hittable **l, int n, float time0, float time1, bool pack_spheres) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<aabb> boxes = primitive_boxes(l, n, time0, time1, "linear_bvh");
+    double bounds_ms = ms_since(start);
+
+    bool all_spheres = pack_spheres && sphere_soa::can_pack(l, n);
+    bvh_builder builder = all_spheres ?
+        bvh_builder(boxes, sphere_leaf_size, sphere_simd_width, sphere_traversal_cost) : bvh_builder(boxes);
+    start = std::chrono::steady_clock::now();
+    prims.resize(n);
+    for (int i = 0; i < n; i++) {
+        prims[i] = l[builder.order[i]];
+        if (pack_spheres)
+            spheres.add(prims[i]);
+        else
+            spheres.add(nullptr);
+    }
+    spheres.finish();
+
+    nodes.reserve(builder.stats.nodes);
+    if (builder.root)
+        flatten_bvh(builder.root, nodes);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].n_prims > 0 && spheres.packed(nodes[i].first_prim, nodes[i].n_prims))
+            nodes[i].flags = linear_bvh_sphere_leaf;
+    }
+    tree = nodes.data();
+    tree_size = int(nodes.size());
+    stats = builder.stats;
+    stats.bytes = nodes.size() * sizeof(linear_bvh_node) + prims.size() * sizeof(hittable*) + spheres.bytes();
+    add_build_phases(stats, bounds_ms, ms_since(start));
+}
+
+linear_bvh::linear_bvh(const linear_bvh_node *n, int n_nodes, const sphere_soa_arrays &a, int slots)
+        : tree(n), tree_size(n_nodes) {
+    spheres.attach(a, slots);
+    stats = bvh_stats();
+    stats.nodes = n_nodes;
+    stats.bytes = size_t(n_nodes) * sizeof(linear_bvh_node);
+}
+
+bool linear_bvh::bounding_box(float t0, float t1, aabb &b) const {
+    if (tree_size == 0)
+        return false;
+    b = tree[0].box;
+    return true;
+}
+
+bool linear_bvh::hit(const ray &r, float t_min, float t_max, hit_record &rec) const {
+    if (tree_size == 0)
+        return false;
+
+    bool hit_anything = false;
+    // The closest packed sphere so far. Its hit_record is only filled in
+    // once traversal is over, and only if nothing closer was found
+    int sphere_index = -1;
+    traverse_linear_bvh(tree, r, t_min, t_max, [&](const linear_bvh_node &node, float &closest) {
+        if (node.flags & linear_bvh_sphere_leaf) {
+            float t;
+            int index;
+            if (spheres.nearest(r, node.first_prim, node.n_prims, t_min, closest, t, index)) {
+                hit_anything = true;
+                closest = t;
+                sphere_index = index;
+            }
+        }
+        else {
+            for (int i = 0; i < node.n_prims; i++) {
+                if (prims[node.first_prim + i]->hit(r, t_min, closest, rec)) {
+                    hit_anything = true;
+                    closest = rec.t;
+                    sphere_index = -1;
+                }
+            }
+        }
+    });
+    if (sphere_index >= 0)
+        spheres.record(r, sphere_index, t_max, rec);
+    return hit_anything;
+}
+
+// Conservative bounds on the slab distances of a whole packet of rays
+// that share direction signs. If the interval test misses a box, every
+// ray in the packet misses it
+struct packet_interval {
+    packet_interval(const box_ray *br, int n) {
+        valid = true;
+        for (int a = 0; a < 3; a++) {
+            sign[a] = br[0].sign[a];
+            orig_lo[a] = orig_hi[a] = br[0].orig[a];
+            inv_lo[a] = inv_hi[a] = br[0].inv_dir[a];
+            for (int k = 1; k < n; k++) {
+                orig_lo[a] = ffmin(orig_lo[a], br[k].orig[a]);
+                orig_hi[a] = ffmax(orig_hi[a], br[k].orig[a]);
+                inv_lo[a] = ffmin(inv_lo[a], br[k].inv_dir[a]);
+                inv_hi[a] = ffmax(inv_hi[a], br[k].inv_dir[a]);
+                valid &= br[k].sign[a] == sign[a];
+            }
+            // Rays parallel to a slab give infinite products
+            valid &= fabs(inv_lo[a]) < MAXFLOAT && fabs(inv_hi[a]) < MAXFLOAT;
+        }
+    }
+
+    // The range of (plane - o) * inv over o in [orig_lo, orig_hi] and inv
+    // in [inv_lo, inv_hi] is spanned by its four corners
+    void range(float plane, int a, float &lo, float &hi) const {
+        float p0 = (plane - orig_lo[a]) * inv_lo[a];
+        float p1 = (plane - orig_lo[a]) * inv_hi[a];
+        float p2 = (plane - orig_hi[a]) * inv_lo[a];
+        float p3 = (plane - orig_hi[a]) * inv_hi[a];
+        lo = ffmin(ffmin(p0, p1), ffmin(p2, p3));
+        hi = ffmax(ffmax(p0, p1), ffmax(p2, p3));
+    }
+
+    bool misses(const aabb &box, float tmin, float tmax) const {
+        for (int a = 0; a < 3; a++) {
+            float near_lo, near_hi, far_lo, far_hi;
+            range(sign[a] ? box.max()[a] : box.min()[a], a, near_lo, near_hi);
+            range(sign[a] ? box.min()[a] : box.max()[a], a, far_lo, far_hi);
+            tmin = ffmax(tmin, near_lo);
+            tmax = ffmin(tmax, far_hi);
+        }
+        return tmin > tmax;
+    }
+
+    bool valid;
+    int sign[3];
+    vec3 orig_lo, orig_hi;
+    vec3 inv_lo, inv_hi;
+};
+
+// Each stack entry remembers the first ray of the packet that is still
+// active for it. At every node the rays are tested in order until one
+// hits the box. When the first active ray misses, the interval test can
+// reject the node for the whole packet at once
+void linear_bvh::hit_packet(const ray_packet &packet, float t_min, float t_max, packet_hits &hits) const {
+    int n = packet.count;
+    box_ray br[packet_size];
+    float closest[packet_size];
+    int sphere_index[packet_size];
+    for (int k = 0; k < n; k++) {
+        br[k] = box_ray(packet.rays[k]);
+        closest[k] = t_max;
+        sphere_index[k] = -1;
+        hits.hit[k] = false;
+    }
+    if (tree_size == 0 || n == 0)
+        return;
+
+    packet_interval interval(br, n);
+    struct entry {
+        int node;
+        int first;
+    };
+    entry stack[bvh_stack_size];
+    int stack_size = 0;
+    entry current = {0, 0};
+    for (;;) {
+        const linear_bvh_node &node = tree[current.node];
+
+        // The packet's closest hits only shrink, so the largest is a
+        // valid upper bound for the interval test
+        float far = closest[current.first];
+        for (int k = current.first + 1; k < n; k++)
+            far = ffmax(far, closest[k]);
+
+        int first = current.first;
+        if (!node.box.hit(br[first], t_min, closest[first])) {
+            if (interval.valid && interval.misses(node.box, t_min, far))
+                first = n;
+            else {
+                for (first++; first < n; first++) {
+                    if (node.box.hit(br[first], t_min, closest[first]))
+                        break;
+                }
+            }
+        }
+
+        if (first < n) {
+            if (node.n_prims > 0) {
+                for (int k = first; k < n; k++) {
+                    if (k > first && !node.box.hit(br[k], t_min, closest[k]))
+                        continue;
+                    const ray &r = packet.rays[k];
+                    if (node.flags & linear_bvh_sphere_leaf) {
+                        float t;
+                        int index;
+                        if (spheres.nearest(r, node.first_prim, node.n_prims, t_min, closest[k], t, index)) {
+                            hits.hit[k] = true;
+                            closest[k] = t;
+                            sphere_index[k] = index;
+                        }
+                    }
+                    else {
+                        for (int i = 0; i < node.n_prims; i++) {
+                            if (prims[node.first_prim + i]->hit(r, t_min, closest[k], hits.rec[k])) {
+                                hits.hit[k] = true;
+                                closest[k] = hits.rec[k].t;
+                                sphere_index[k] = -1;
+                            }
+                        }
+                    }
+                }
+            }
+            else {
+                // Rays that do not share direction signs disagree on the
+                // near child, the first active ray decides
+                entry near_child = {current.node + 1, first};
+                entry far_child = {node.second_child, first};
+                if (br[first].sign[node.axis]) {
+                    entry swap = near_child;
+                    near_child = far_child;
+                    far_child = swap;
+                }
+                stack[stack_size++] = far_child;
+                current = near_child;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    for (int k = 0; k < n; k++) {
+        if (sphere_index[k] >= 0)
+            spheres.record(packet.rays[k], sphere_index[k], closest[k], hits.rec[k]);
+    }
+}
+
+#endif
@@ -1,7 +1,13 @@
 #include <iostream>
-#include <fstream>
+#include <cstring>
+#include <thread>
+#include <chrono>
 
+#include "arena.h"
 #include "bvh.h"
+#include "linear_bvh.h"
+#include "bvh4.h"
+#include "motion_bvh.h"
 #include "sphere.h"
 #include "camera.h"
 #include "perlin.h"
@@ -9,172 +15,518 @@
 #include "material.h"
 #include "moving_sphere.h"
 #include "hittable_list.h"
+#include "framebuffer.h"
+#include "tile_scheduler.h"
+#include "render.h"
+#include "progressive.h"
+#include "strips.h"
+#include "image.h"
+#include "scene.h"
+#include "compiled_scene.h"
+#include "sequence.h"
+#include "bench.h"
 
 // Write a ppm image file with a background, and a sphere using ray tracing
 
-vec3 color(const ray& r, hittable *world, int depth) {
-    hit_record rec;
-
-    // If a ray from the origin hits a hittable object, return the normal
-    // Represented by colors
-
-    // Setting t_min to 0.001 (instead of 0) prevents shadow acne
-    if (world->hit(r, 0.001, MAXFLOAT, rec)) {
-        ray scattered;
-        vec3 attenuation;
-        if (depth < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-             return attenuation * color(scattered, world, depth + 1);
-        }
-        else {
-            return vec3(0, 0 , 0);
-        }
-    }
-
-    // If a ray hits nothing, blend white and blue based on the ray's y coord
-    else {
-        // Turn ray into a unit vector. This makes -1.0 < y < 1.0
-        vec3 unit_direction = unit_vector(r.direction());
-
-        // Scale ray to 0.0 < t < 1.0
-        float t = 0.5 * (unit_direction.y() + 1.0);
-
-        // Return a linear interpolation (lerp) between
-        // blue (t=1.0) and white (t=0.0)
-        return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
-    }
-}
-
-hittable *random_scene() {
-    int n = 500;
-    hittable **list = new hittable*[n+1];
+// Small spheres are scattered over a 2*grid by 2*grid patch of the ground
+// Everything is allocated from memory, in the order it is made
+hittable_list *random_scene(rng &random, int grid, arena &memory) {
+    int n = 4*grid*grid + 4;
+    hittable **list = memory.make_array<hittable*>(n+1, list_memory);
 
     // The sphere which all others sit upon
-    texture *checker = new checker_texture(
-        new constant_texture(vec3(0.2, 0.3, 0.1)),
-        new constant_texture(vec3(0.9, 0.9, 0.9))
+    texture *checker = memory.make<checker_texture>(texture_memory,
+        memory.make<constant_texture>(texture_memory, vec3(0.2, 0.3, 0.1)),
+        memory.make<constant_texture>(texture_memory, vec3(0.9, 0.9, 0.9))
     );
-    list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(checker));
+    list[0] = memory.make<sphere>(primitive_memory, vec3(0, -1000, 0), 1000,
+                                  memory.make<lambertian>(material_memory, checker));
 
     int i = 1;
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            float choose_mat = drand48();
-            vec3 center(a+0.9*drand48(), 0.2, b+0.9*drand48());
+    for (int a = -grid; a < grid; a++) {
+        for (int b = -grid; b < grid; b++) {
+            float choose_mat = random.next_float();
+            vec3 center(a+0.9*random.next_float(), 0.2, b+0.9*random.next_float());
             if ((center-vec3(4,0.2,0)).length() > 0.9) {
                 //  Diffuse
                 if (choose_mat < 0.8) {
-                    list[i++] = new moving_sphere(
+                    list[i++] = memory.make<moving_sphere>(primitive_memory,
                         center,
-                        center+vec3(0, 0.5*drand48(), 0),
+                        center+vec3(0, 0.5*random.next_float(), 0),
                         0.0, 1.0, 0.2,
-                        new lambertian( new constant_texture(vec3(
-                                            drand48()*drand48(),
-                                            drand48()*drand48(),
-                                            drand48()*drand48())))
+                        memory.make<lambertian>(material_memory,
+                            memory.make<constant_texture>(texture_memory, vec3(
+                                random.next_float()*random.next_float(),
+                                random.next_float()*random.next_float(),
+                                random.next_float()*random.next_float())))
                     );
                 }
                 // Metal
                 else if (choose_mat < 0.95) {
-                    list[i++] = new sphere(
+                    list[i++] = memory.make<sphere>(primitive_memory,
                         center, 0.2,
-                        new metal(vec3(0.5*(1 + drand48()),
-                                       0.5*(1 + drand48()),
-                                       0.5*(1 + drand48())),
-                                    0.5*drand48())
+                        memory.make<metal>(material_memory,
+                                           vec3(0.5*(1 + random.next_float()),
+                                                0.5*(1 + random.next_float()),
+                                                0.5*(1 + random.next_float())),
+                                           0.5*random.next_float())
                     );
                 }
                 // Glass
                 else {
-                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
+                    list[i++] = memory.make<sphere>(primitive_memory, center, 0.2,
+                                                    memory.make<dielectric>(material_memory, 1.5));
                 }
             }
         }
     }
 
-    texture *pertext = new noise_texture(2);
-    list[i++] = new sphere(vec3(0, 1, 0), 1.0, new lambertian(pertext));
-    list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(new constant_texture(vec3(0.4, 0.2, 0.1))));
-    list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
+    texture *pertext = memory.make<noise_texture>(texture_memory, 2);
+    list[i++] = memory.make<sphere>(primitive_memory, vec3(0, 1, 0), 1.0,
+                                    memory.make<lambertian>(material_memory, pertext));
+    list[i++] = memory.make<sphere>(primitive_memory, vec3(-4, 1, 0), 1.0,
+                                    memory.make<lambertian>(material_memory,
+                                        memory.make<constant_texture>(texture_memory, vec3(0.4, 0.2, 0.1))));
+    list[i++] = memory.make<sphere>(primitive_memory, vec3(4, 1, 0), 1.0,
+                                    memory.make<metal>(material_memory, vec3(0.7, 0.6, 0.5), 0.0));
 
-    return new bvh_node(list, i, 0.0, 1.0);
+    return memory.make<hittable_list>(list_memory, list, i);
 }
 
-int main() {
+int main(int argc, char **argv) {
+    auto program_start = std::chrono::steady_clock::now();
     // Set the width and height of canvas
     int nx = 352;
     int ny = 240;
     int ns = 25;
+    int n_threads = std::thread::hardware_concurrency();
+    int tile_size = 16;
+    int grid = 11;
+    const char *bench = nullptr;
+    const char *accel = "bvh4";
+    bool packets = false;
+    const char *integrator = "iterative";
+    path_options path;
+    float adaptive = 0;
+    int min_spp = 16, max_spp = 64;
+    int passes = 0, pass_spp = 4, checkpoint_every = 4;
+    const char *checkpoint = nullptr;
+    bool resume = false;
+    int strip_rows = 0;
+    const char *output = "./out.ppm";
+    const char *scene_path = nullptr;
+    const char *write_scene = nullptr;
+    const char *cache = nullptr;
+    bool size_given = false, spp_given = false;
+    sequence_settings seq;
+    bool sequence = false;
+    const char *views_path = nullptr;
 
-    // Create a ppm file to store the image data
-    std::ofstream ofs;
-    ofs.open("./out.ppm");
-
-    // ppm is a image file format that can be defined with plain text
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+            n_threads = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--grid") == 0 && a + 1 < argc)
+            grid = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--accel") == 0 && a + 1 < argc)
+            accel = argv[++a];
+        else if (strcmp(argv[a], "--packets") == 0)
+            packets = true;
+        else if (strcmp(argv[a], "--integrator") == 0 && a + 1 < argc)
+            integrator = argv[++a];
+        else if (strcmp(argv[a], "--max-depth") == 0 && a + 1 < argc)
+            path.max_depth = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--rr-depth") == 0 && a + 1 < argc)
+            path.rr_depth = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--adaptive") == 0 && a + 1 < argc)
+            adaptive = atof(argv[++a]);
+        else if (strcmp(argv[a], "--min-spp") == 0 && a + 1 < argc)
+            min_spp = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--max-spp") == 0 && a + 1 < argc)
+            max_spp = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--progressive") == 0 && a + 1 < argc)
+            passes = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--pass-spp") == 0 && a + 1 < argc)
+            pass_spp = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--checkpoint") == 0 && a + 1 < argc)
+            checkpoint = argv[++a];
+        else if (strcmp(argv[a], "--checkpoint-every") == 0 && a + 1 < argc)
+            checkpoint_every = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--resume") == 0)
+            resume = true;
+        else if (strcmp(argv[a], "--output") == 0 && a + 1 < argc)
+            output = argv[++a];
+        else if (strcmp(argv[a], "--size") == 0 && a + 1 < argc) {
+            if (sscanf(argv[++a], "%dx%d", &nx, &ny) != 2 || nx < 1 || ny < 1) {
+                std::cerr << "--size takes WIDTHxHEIGHT\n";
+                return 1;
+            }
+            size_given = true;
+        }
+        else if (strcmp(argv[a], "--spp") == 0 && a + 1 < argc) {
+            ns = atoi(argv[++a]);
+            spp_given = true;
+        }
+        else if (strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+            scene_path = argv[++a];
+        else if (strcmp(argv[a], "--write-scene") == 0 && a + 1 < argc)
+            write_scene = argv[++a];
+        else if (strcmp(argv[a], "--cache") == 0 && a + 1 < argc)
+            cache = argv[++a];
+        else if (strcmp(argv[a], "--strips") == 0 && a + 1 < argc)
+            strip_rows = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--frames") == 0 && a + 2 < argc) {
+            seq.first = atoi(argv[++a]);
+            seq.last = atoi(argv[++a]);
+            sequence = true;
+        }
+        else if (strcmp(argv[a], "--fps") == 0 && a + 1 < argc)
+            seq.fps = atof(argv[++a]);
+        else if (strcmp(argv[a], "--shutter-angle") == 0 && a + 1 < argc)
+            seq.shutter_angle = atof(argv[++a]);
+        else if (strcmp(argv[a], "--views") == 0 && a + 1 < argc)
+            views_path = argv[++a];
+        else if (strcmp(argv[a], "--bench") == 0 && a + 1 < argc)
+            bench = argv[++a];
+        else {
+            std::cerr << "usage: " << argv[0] << " [--threads N] [--grid N] [--scene FILE] [--write-scene FILE] [--cache FILE] [--output FILE.ppm|pfm|qoi] [--size WxH] [--spp N] [--strips ROWS] [--accel bvh|lbvh|bvh4|mbvh] [--packets]"
+                         " [--integrator recursive|iterative|wavefront] [--max-depth N] [--rr-depth N]"
+                         " [--adaptive ERROR] [--min-spp N] [--max-spp N]"
+                         " [--progressive PASSES] [--pass-spp N] [--checkpoint FILE] [--checkpoint-every N] [--resume]"
+                         " [--frames FIRST LAST] [--fps N] [--shutter-angle DEGREES] [--views FILE]"
+                         " [--bench aabb|spheres|packets|integrators|adaptive|motion|build|refit|oversized]\n";
+            return 1;
+        }
+    }
 
-    // Example ppm file:
-    // P3
-    // 3 2
-    // 255
-    // 255    0   0
-    // 0    255 255
-    // ...
+    if (bench && strcmp(bench, "aabb") == 0) {
+        bench_aabb();
+        return 0;
+    }
+    if (n_threads < 1)
+        n_threads = 1;
+    // BVHs are built on as many threads as render
+    bvh_build_threads = n_threads;
+    if (!supported_image(output)) {
+        std::cerr << "output must be a .ppm, .pfm or .qoi file\n";
+        return 1;
+    }
+    if (sequence && (seq.last < seq.first || seq.fps <= 0 || seq.shutter_angle < 0)) {
+        std::cerr << "--frames needs FIRST <= LAST, a positive --fps and a shutter angle of at least 0\n";
+        return 1;
+    }
+    if (sequence && !frame_pattern_ok(output)) {
+        std::cerr << "with --frames, a '%' in --output must start a single %d or %0Nd for the frame number\n";
+        return 1;
+    }
+    if (sequence && (cache || write_scene || bench || strip_rows > 0 || passes > 0 || packets)) {
+        std::cerr << "--frames cannot be used with --cache, --write-scene, --bench, --strips, --progressive or --packets\n";
+        return 1;
+    }
 
-    // 1st line: P3 means colors are in ASCII
-    // 2nd line: Define number of columns and rows
-    // 3rd line: Max color
-    // Nth line: RGB triplets
+    // Create hittable objects, from a compiled scene, a scene file or
+    // generated. The random scene has its own fixed seed so it is the same
+    // on every run. The command line overrides the image settings of a
+    // scene file
+    arena scene_memory;
+    scene_description loaded;
+    compiled_scene compiled;
+    uint64_t cache_key = 0;
+    bool from_cache = false;
+    if (cache && !write_scene) {
+        // The source is hashed, not parsed, to tell whether the cache is
+        // still current
+        uint64_t source = mix_seed(uint64_t(grid));
+        if (scene_path && !hash_file(scene_path, source))
+            return 1;
+        cache_key = compiled_scene_key(source);
+        from_cache = compiled.map(cache, cache_key, scene_memory);
+        if (from_cache) {
+            loaded = compiled.description;
+            loaded.hash = scene_path ? source : 0;
+        }
+    }
+    if (!from_cache && scene_path) {
+        if (!load_scene(scene_path, scene_memory, loaded))
+            return 1;
+    }
+    else if (!from_cache) {
+        rng scene_rng;
+        loaded.objects = random_scene(scene_rng, grid, scene_memory);
+    }
+    if (!size_given && loaded.nx > 0 && loaded.ny > 0) {
+        nx = loaded.nx;
+        ny = loaded.ny;
+    }
+    if (!spp_given && loaded.ns > 0)
+        ns = loaded.ns;
+    if (ns < 1)
+        ns = 1;
+    if (write_scene) {
+        loaded.nx = nx;
+        loaded.ny = ny;
+        loaded.ns = ns;
+        return save_scene(write_scene, loaded) ? 0 : 1;
+    }
+    if (views_path && !load_views(views_path, loaded.view, loaded.views))
+        return 1;
+    // Views from the scene file or --views are rendered as one batch
+    bool batch = !loaded.views.empty();
+    if (batch && (sequence || cache || bench || strip_rows > 0 || passes > 0 || adaptive > 0)) {
+        std::cerr << "views cannot be rendered with --frames, --cache, --bench, --strips, --progressive or --adaptive\n";
+        return 1;
+    }
+    for (size_t k = 0; k < loaded.views.size(); k++) {
+        if (!supported_image(loaded.views[k].output.c_str())) {
+            std::cerr << "view " << loaded.views[k].output << " must be a .ppm, .pfm or .qoi file\n";
+            return 1;
+        }
+    }
+    hittable_list *scene = loaded.objects;
+    if (!from_cache && scene->list_size < 1) {
+        std::cerr << "the scene is empty\n";
+        return 1;
+    }
+    // Planes and primitives far larger than the rest are tested next to the
+    // tree instead of inside it. A compiled scene and ray packets only walk
+    // the linear BVH, so there everything stays in it and planes are refused
+    float time0 = sequence ? seq.open(seq.first) : 0.0, time1 = sequence ? seq.close(seq.first) : 1.0;
+    int n_outside = 0;
+    if (!from_cache) {
+        n_outside = separate_oversized(scene->list, scene->list_size, time0, time1,
+                                       cache || packets ? INFINITY : oversized_factor);
+        if ((cache || packets) && n_outside > 0) {
+            std::cerr << "--cache and --packets cannot be used with planes\n";
+            return 1;
+        }
+        if (n_outside == scene->list_size) {
+            std::cerr << "the scene needs an object besides planes\n";
+            return 1;
+        }
+    }
+    hittable **bounded = from_cache ? nullptr : scene->list + n_outside;
+    int n_bounded = from_cache ? 0 : scene->list_size - n_outside;
+    hittable *world;
+    bvh_node *tree = nullptr;
+    if (from_cache)
+        world = compiled.bvh;
+    else if (cache) {
+        // The compiled scene holds a linear BVH, whatever --accel says
+        linear_bvh *bvh = new linear_bvh(bounded, n_bounded, 0.0, 1.0);
+        print_bvh_stats("lbvh", bvh->stats);
+        write_compiled_scene(cache, cache_key, loaded, *bvh);
+        world = bvh;
+    }
+    else if (strcmp(accel, "bvh") == 0 || sequence) {
+        // A sequence always uses bvh_node, built for its first frame and
+        // refitted from frame to frame
+        tree = scene_memory.make<bvh_node>(accel_memory, bounded, n_bounded, time0, time1, scene_memory);
+        print_bvh_stats("bvh", *tree->stats);
+        world = tree;
+    }
+    else if (strcmp(accel, "lbvh") == 0) {
+        linear_bvh *bvh = new linear_bvh(bounded, n_bounded, 0.0, 1.0);
+        print_bvh_stats("lbvh", bvh->stats);
+        world = bvh;
+    }
+    else if (strcmp(accel, "bvh4") == 0) {
+        bvh4 *bvh = new bvh4(bounded, n_bounded, 0.0, 1.0);
+        print_bvh_stats("bvh4", bvh->stats);
+        world = bvh;
+    }
+    else if (strcmp(accel, "mbvh") == 0) {
+        motion_bvh *bvh = new motion_bvh(bounded, n_bounded, loaded.view.time0, loaded.view.time1);
+        print_bvh_stats("mbvh", bvh->stats);
+        fprintf(stderr, "mbvh: %d temporal splits, %zu primitive references\n", bvh->temporal_splits, bvh->prims.size());
+        world = bvh;
+    }
+    else {
+        std::cerr << "unknown acceleration structure " << accel << "\n";
+        return 1;
+    }
+    if (n_outside > 0) {
+        hittable **parts = scene_memory.make_array<hittable*>(n_outside + 1, list_memory);
+        std::copy(scene->list, bounded, parts);
+        parts[n_outside] = world;
+        world = scene_memory.make<hittable_list>(list_memory, parts, n_outside + 1);
+        fprintf(stderr, "Planes and oversized objects tested outside the tree: %d\n", n_outside);
+    }
+    scene_memory.print_usage("scene");
 
-    ofs << "P3\n" << nx << " " << ny << "\n255\n";
+    // Instantiate camera
+    const camera_settings &view = loaded.view;
+    camera cam(view.lookfrom, view.lookat, view.vup, view.vfov, float(nx) / float(ny),
+               view.aperture, view.focus_dist, view.time0, view.time1);
 
-    // Create hittable objects
-    hittable *world = random_scene();
+    render_settings settings;
+    settings.nx = nx;
+    settings.ny = ny;
+    settings.ns = ns;
+    settings.tile_size = tile_size;
+    settings.packets = packets;
+    settings.path = path;
+    settings.adaptive_threshold = adaptive;
+    settings.min_spp = min_spp < 2 ? 2 : min_spp;
+    settings.max_spp = max_spp < settings.min_spp ? settings.min_spp : max_spp;
+    if (strcmp(integrator, "recursive") == 0)
+        settings.integrator = recursive_kind;
+    else if (strcmp(integrator, "iterative") == 0)
+        settings.integrator = iterative_kind;
+    else if (strcmp(integrator, "wavefront") == 0)
+        settings.integrator = wavefront_kind;
+    else {
+        std::cerr << "unknown integrator " << integrator << "\n";
+        return 1;
+    }
+    // Packets of primary rays walk the linear BVH together
+    if (packets && (settings.integrator == wavefront_kind || !dynamic_cast<linear_bvh*>(world))) {
+        std::cerr << "--packets needs --accel lbvh and a per-ray integrator\n";
+        return 1;
+    }
+    if (adaptive > 0 && (packets || settings.integrator == wavefront_kind)) {
+        std::cerr << "--adaptive needs a per-ray integrator without --packets\n";
+        return 1;
+    }
+    if (passes > 0 && (adaptive > 0 || packets || settings.integrator == wavefront_kind)) {
+        std::cerr << "--progressive needs a per-ray integrator without --packets or --adaptive\n";
+        return 1;
+    }
+    if (strip_rows > 0 && passes > 0) {
+        std::cerr << "--strips cannot be used with --progressive\n";
+        return 1;
+    }
+    if (resume && (!checkpoint || passes <= 0)) {
+        std::cerr << "--resume needs --progressive and --checkpoint\n";
+        return 1;
+    }
+    if (pass_spp < 1)
+        pass_spp = 1;
+    if (checkpoint_every < 1)
+        checkpoint_every = 1;
 
-    // Instantiate camera
-    vec3 lookfrom(13, 2, 3);
-    vec3 lookat(0, 0, 0);
-    float dist_to_focus = 10.0; //(lookfrom - lookat).length();
-    float aperture = 0.0;
-
-    camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny),
-               aperture, dist_to_focus, 0.0, 1.0);
-
-    // Write pixels out in rows from left to right (int i)
-    // Write rows from top to bottom (int j)
-    // Set r, g, and b to values between 0.0 and 1.0
-    // Convert from 0 to 1 float range to 0 to 256 int range
-    // Write RGB triplet to file
-    for (int j = ny-1; j>= 0; j--) {
-        // Display rendering progress in console as a percentage
-        if (j % 5 == 0){
-            fprintf(stderr,"\rRendering (%dx%d) %5.2f%%", nx, ny, double(100.0*((ny-j)*nx)/(ny*nx)));
+    tile_scheduler scheduler(n_threads);
+    if (bench) {
+        if (!scene && (strcmp(bench, "spheres") == 0 || strcmp(bench, "packets") == 0 ||
+                       strcmp(bench, "build") == 0 || strcmp(bench, "refit") == 0 ||
+                       strcmp(bench, "oversized") == 0)) {
+            std::cerr << "--bench " << bench << " needs the scene objects, not a compiled scene\n";
+            return 1;
         }
+        if (strcmp(bench, "spheres") == 0)
+            bench_spheres(scene, cam);
+        else if (strcmp(bench, "packets") == 0)
+            bench_packets(scene, cam, nx, ny);
+        else if (strcmp(bench, "integrators") == 0)
+            bench_integrators(world, cam, settings, scheduler);
+        else if (strcmp(bench, "adaptive") == 0)
+            bench_adaptive(world, cam, settings, scheduler);
+        else if (strcmp(bench, "motion") == 0)
+            bench_motion(settings, scheduler);
+        else if (strcmp(bench, "build") == 0)
+            bench_build(scene, n_threads);
+        else if (strcmp(bench, "refit") == 0)
+            bench_refit(scene, cam);
+        else if (strcmp(bench, "oversized") == 0)
+            bench_oversized(scene, cam);
+        else {
+            std::cerr << "unknown benchmark " << bench << "\n";
+            return 1;
+        }
+        return 0;
+    }
 
-        for (int i = 0; i < nx; i++) {
-            // Multisample Antialiasing (MSAA)
-            // Send ns samples through each pixel, with the direction of each
-            // ray slightly randomized. The pixel takes the average color of
-            // these sample rays. This blends the foreground and background on
-            // edge pixels.
-            vec3 col(0, 0, 0);
-            for (int s=0; s < ns; s++) {
-                float u = float(i + drand48()) / float(nx);
-                float v = float(j + drand48()) / float(ny);
-                ray r = cam.get_ray(u, v);
-                col += color(r, world, 0);
-            }
+    render_stats stats;
+    // Whether every image and checkpoint was written
+    bool written = true;
+    if (sequence) {
+        stats = render_sequence(seq, settings, loaded, world, tree, bounded, n_bounded, scheduler, output, scene_memory);
+        if (stats.samples == 0)
+            return 1;
+    }
+    else if (batch) {
+        // Everything up to here, loading the scene and building its tree,
+        // is done once for all the views
+        double setup_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - program_start).count();
+        int n_views = int(loaded.views.size());
+        std::vector<camera> cams;
+        std::vector<framebuffer> fbs;
+        cams.reserve(n_views);
+        fbs.reserve(n_views);
+        for (int k = 0; k < n_views; k++) {
+            const camera_settings &v = loaded.views[k].view;
+            cams.push_back(camera(v.lookfrom, v.lookat, v.vup, v.vfov, float(nx) / float(ny),
+                                  v.aperture, v.focus_dist, v.time0, v.time1));
+            fbs.push_back(framebuffer(nx, ny));
+        }
+        std::vector<camera*> cam_list;
+        std::vector<framebuffer*> fb_list;
+        for (int k = 0; k < n_views; k++) {
+            cam_list.push_back(&cams[k]);
+            fb_list.push_back(&fbs[k]);
+        }
+        stats = render_views(settings, world, cam_list, scheduler, fb_list);
+        for (int k = 0; k < n_views; k++)
+            written = write_image(loaded.views[k].output.c_str(), fbs[k]) && written;
+        double total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - program_start).count();
+        // Separate runs would each load the scene and build the tree again
+        fprintf(stderr, "%d views: setup %.2f s once, render %.2f s, %.2f s in all; %d separate runs would take about %.2f s\n",
+                n_views, setup_seconds, stats.seconds, total_seconds, n_views,
+                n_views * setup_seconds + (total_seconds - setup_seconds));
+    }
+    else if (strip_rows > 0) {
+        stats = render_strips(settings, world, cam, scheduler, output, strip_rows);
+        if (stats.samples == 0)
+            return 1;
+    }
+    else if (passes > 0) {
+        // Everything that changes the image, so a checkpoint is only
+        // resumed by the same render
+        uint64_t key = mix_seed(scene_path ? loaded.hash : uint64_t(grid));
+        key = mix_seed(key ^ uint64_t(path.max_depth));
+        key = mix_seed(key ^ uint64_t(path.rr_depth));
+        key = mix_seed(key ^ uint64_t(settings.integrator));
 
-            col /= float(ns);
+        framebuffer fb(nx, ny);
+        accumulator acc(nx, ny);
+        image_writer preview;
+        // A checkpoint that cannot be resumed is left alone rather than
+        // overwritten by a render from scratch
+        if (resume) {
+            if (!acc.load(checkpoint, key))
+                return 1;
+            fprintf(stderr, "Resuming %s at %.2f samples per pixel\n",
+                    checkpoint, double(acc.total_samples()) / (nx * ny));
+        }
 
-            // Gamma correct pixel values
-            col = vec3( sqrt(col[0]), sqrt(col[1]), sqrt(col[2]) );
+        stats.rays = 0;
+        stats.seconds = 0;
+        for (int pass = 1; pass <= passes; pass++) {
+            render_stats pass_stats = render_pass(settings, world, cam, scheduler, acc, pass_spp);
+            stats.rays += pass_stats.rays;
+            stats.seconds += pass_stats.seconds;
 
-            // Scale pixel values from float 0 to 1, to int 0 to 256
-            int ir = int(255.99*col[0]);
-            int ig = int(255.99*col[1]);
-            int ib = int(255.99*col[2]);
-            ofs << ir << " " << ig << " " << ib << "\n";
+            // A preview after every pass, written while the next pass renders
+            acc.resolve(fb);
+            preview.write(output, fb);
+            if (checkpoint && (pass % checkpoint_every == 0 || pass == passes))
+                written = acc.save(checkpoint, key) && written;
         }
+        written = preview.wait() && written;
+        stats.samples = (long long)passes * pass_spp * nx * ny;
     }
+    else {
+        framebuffer fb(nx, ny);
+        stats = render(settings, world, cam, scheduler, fb);
+        written = write_image(output, fb);
 
-    ofs.close();
+        // With adaptive sampling, also write the samples each pixel took as a
+        // grey level, white for max_spp, next to the image
+        if (adaptive > 0)
+            written = write_samples_ppm(samples_path(output).c_str(), fb, settings.max_spp) && written;
+    }
+    int frames = sequence ? seq.last - seq.first + 1 : batch ? int(loaded.views.size()) : 1;
+    fprintf(stderr, "%lld rays in %.2f s, %.2f Mrays/s\n",
+            stats.rays, stats.seconds, stats.rays / stats.seconds * 1e-6);
+    fprintf(stderr, "%.2f rays per path, %.2f samples per pixel\n",
+            double(stats.rays) / stats.samples, double(stats.samples) / (double(nx) * ny * frames));
+    return written ? 0 : 1;
 }
@@ -2,6 +2,7 @@
 #define MATERIALH
 
 #include "ray.h"
+#include "random.h"
 #include "texture.h"
 #include "hittable.h"
 
@@ -32,27 +33,39 @@ bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted) {
 }
 
 // Used to create diffuse materials
-vec3 random_in_unit_sphere() {
+vec3 random_in_unit_sphere(rng &random) {
     vec3 p;
     // Select a random point in a unit cube
     // Repeat until that point is also in unit sphere
     // Point is in unit sphere if squared length is less than 1.0
     do {
-        p = 2.0 * vec3(drand48(),drand48(),drand48()) - vec3(1,1,1);
+        p = 2.0 * vec3(random.next_float(), random.next_float(), random.next_float()) - vec3(1,1,1);
     } while (p.squared_length() >= 1.0);
     return p;
 }
 
+// The concrete type of a material, so batched integrators can group hits
+// and call one scatter() for a whole batch without virtual dispatch
+enum material_kind {
+    lambertian_kind,
+    metal_kind,
+    dielectric_kind,
+    material_kinds
+};
+
 class material {
 public:
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const = 0;
+    material(material_kind k) : kind(k) {}
+    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng &random) const = 0;
+
+    material_kind kind;
 };
 
 class lambertian : public material {
 public:
-    lambertian(texture *a) : albedo(a) {}
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
-        vec3 target = rec.p + rec.normal + random_in_unit_sphere();
+    lambertian(texture *a) : material(lambertian_kind), albedo(a) {}
+    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng &random) const {
+        vec3 target = rec.p + rec.normal + random_in_unit_sphere(random);
         scattered = ray(rec.p, target-rec.p,  r_in.time());
         attenuation = albedo->value(0, 0, rec.p);
         return true;
@@ -64,10 +77,10 @@ public:
 
 class metal : public material {
 public:
-    metal(const vec3& a, float f) : albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
+    metal(const vec3& a, float f) : material(metal_kind), albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
+    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng &random) const {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
+        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(random));
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -78,8 +91,8 @@ public:
 
 class dielectric : public material {
 public:
-    dielectric(float ri) : ref_idx(ri) {}
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const  {
+    dielectric(float ri) : material(dielectric_kind), ref_idx(ri) {}
+    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng &random) const  {
             vec3 outward_normal;
             vec3 reflected = reflect(r_in.direction(), rec.normal);
             float ni_over_nt;
@@ -103,7 +116,7 @@ public:
                 reflect_prob = schlick(cosine, ref_idx);
             else
                 reflect_prob = 1.0;
-            if (drand48() < reflect_prob)
+            if (random.next_float() < reflect_prob)
                 scattered = ray(rec.p, reflected);
             else
                 scattered = ray(rec.p, refracted);
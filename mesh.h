@@ -0,0 +1,294 @@
+#ifndef MESHH
+#define MESHH
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include "hittable.h"
+#include "bvh_build.h"
+#include "linear_bvh.h"
+#include "parse_number.h"
+
+// A triangle mesh. Triangles are not objects of their own: they are three
+// indices into a vertex buffer shared by the whole mesh, and the mesh has
+// its own BVH over them, flattened like linear_bvh. To the scene the mesh
+// is one primitive, whose box is the box of all its triangles.
+// The normal of a triangle follows its winding, counter clockwise seen
+// from the front
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh(std::vector<vec3> &v, std::vector<int> &i, material *m);
+
+        virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb &box) const;
+
+        int triangles() const { return int(indices.size() / 3); }
+
+        std::vector<vec3> vertices;
+        // Three vertex indices per triangle, in leaf order of the BVH
+        std::vector<int> indices;
+        std::vector<linear_bvh_node> nodes;
+        material *mat_ptr;
+        // The file the mesh was loaded from, if any, as an absolute path
+        std::string source;
+        bvh_stats stats;
+
+    private:
+        bool intersect(const ray &r, int tri, float t_min, float t_max, float &t) const;
+};
+
+triangle_mesh::triangle_mesh(std::vector<vec3> &v, std::vector<int> &i, material *m) : mat_ptr(m) {
+    vertices.swap(v);
+    auto start = std::chrono::steady_clock::now();
+    int n = int(i.size() / 3);
+    std::vector<aabb> boxes(n);
+    parallel_chunks(n, chunk_count(n, build_thread_count()), [&](int, int from, int to) {
+        for (int k = from; k < to; k++) {
+            const vec3 &a = vertices[i[3*k]], &b = vertices[i[3*k+1]], &c = vertices[i[3*k+2]];
+            boxes[k] = aabb(vec3(ffmin(a.x(), ffmin(b.x(), c.x())), ffmin(a.y(), ffmin(b.y(), c.y())),
+                                 ffmin(a.z(), ffmin(b.z(), c.z()))),
+                            vec3(ffmax(a.x(), ffmax(b.x(), c.x())), ffmax(a.y(), ffmax(b.y(), c.y())),
+                                 ffmax(a.z(), ffmax(b.z(), c.z()))));
+        }
+    });
+    double bounds_ms = ms_since(start);
+    bvh_builder builder(boxes);
+    boxes = std::vector<aabb>();
+    start = std::chrono::steady_clock::now();
+
+    // Store the triangles in leaf order so a leaf is a range of them
+    indices.resize(3 * size_t(n));
+    for (int k = 0; k < n; k++) {
+        int from = builder.order[k];
+        for (int c = 0; c < 3; c++)
+            indices[3*k + c] = i[3*from + c];
+    }
+    i = std::vector<int>();
+
+    nodes.reserve(builder.stats.nodes);
+    if (builder.root)
+        flatten_bvh(builder.root, nodes);
+    stats = builder.stats;
+    stats.bytes = nodes.size() * sizeof(linear_bvh_node) + indices.size() * sizeof(int) +
+                  vertices.size() * sizeof(vec3);
+    add_build_phases(stats, bounds_ms, ms_since(start));
+}
+
+bool triangle_mesh::bounding_box(float t0, float t1, aabb &b) const {
+    if (nodes.empty())
+        return false;
+    b = nodes[0].box;
+    return true;
+}
+
+// Moller-Trumbore: solve o + t d = v0 + u e1 + v e2 by Cramer's rule,
+// sharing the cross products between the determinants
+bool triangle_mesh::intersect(const ray &r, int tri, float t_min, float t_max, float &t) const {
+    const vec3 &v0 = vertices[indices[3*tri]];
+    vec3 e1 = vertices[indices[3*tri+1]] - v0;
+    vec3 e2 = vertices[indices[3*tri+2]] - v0;
+    vec3 pvec = cross(r.direction(), e2);
+    float det = dot(e1, pvec);
+    // The ray is parallel to the triangle
+    if (det == 0)
+        return false;
+    float inv_det = 1 / det;
+    vec3 tvec = r.origin() - v0;
+    float u = dot(tvec, pvec) * inv_det;
+    if (u < 0 || u > 1)
+        return false;
+    vec3 qvec = cross(tvec, e1);
+    float v = dot(r.direction(), qvec) * inv_det;
+    if (v < 0 || u + v > 1)
+        return false;
+    float temp = dot(e2, qvec) * inv_det;
+    if (!(temp < t_max && temp > t_min))
+        return false;
+    t = temp;
+    return true;
+}
+
+bool triangle_mesh::hit(const ray &r, float t_min, float t_max, hit_record &rec) const {
+    if (nodes.empty())
+        return false;
+
+    // Only the index of the nearest triangle is kept, its hit_record is
+    // filled in at the end
+    int nearest = -1;
+    traverse_linear_bvh(nodes.data(), r, t_min, t_max, [&](const linear_bvh_node &node, float &closest) {
+        for (int i = node.first_prim; i < node.first_prim + node.n_prims; i++) {
+            float t;
+            if (intersect(r, i, t_min, closest, t)) {
+                closest = t;
+                nearest = i;
+            }
+        }
+    });
+    if (nearest < 0)
+        return false;
+
+    const vec3 &v0 = vertices[indices[3*nearest]];
+    rec.t = t_max;
+    rec.p = r.point_at_parameter(t_max);
+    rec.normal = unit_vector(cross(vertices[indices[3*nearest+1]] - v0, vertices[indices[3*nearest+2]] - v0));
+    rec.mat_ptr = mat_ptr;
+    return true;
+}
+
+// Streams a Wavefront OBJ file through a fixed size buffer. Lines are
+// parsed where they lie in the buffer, and a line cut by the end of the
+// buffer is moved to its start before the next read, so nothing is
+// allocated per line. Only vertices (v) and faces (f) are read; faces
+// with more than three vertices are split into a fan of triangles, and
+// texture and normal indices (f 1/2/3) are skipped
+class obj_loader {
+    public:
+        obj_loader(const char *p) : path(p), line(0) {}
+        bool load(std::vector<vec3> &vertices, std::vector<int> &indices, size_t &bytes);
+
+    private:
+        bool parse_line(const char *s, const char *e, std::vector<vec3> &vertices, std::vector<int> &indices);
+        bool error(const char *message);
+
+        const char *path;
+        long long line;
+        // The face being read, reused from line to line
+        std::vector<int> face;
+};
+
+bool obj_loader::error(const char *message) {
+    fprintf(stderr, "%s:%lld: %s\n", path, line, message);
+    return false;
+}
+
+// The next space separated word of [s, e)
+inline bool next_word(const char *&s, const char *e, const char *&word, const char *&word_end) {
+    while (s < e && (*s == ' ' || *s == '\t' || *s == '\r'))
+        s++;
+    if (s == e)
+        return false;
+    word = s;
+    while (s < e && *s != ' ' && *s != '\t' && *s != '\r')
+        s++;
+    word_end = s;
+    return true;
+}
+
+bool obj_loader::parse_line(const char *s, const char *e, std::vector<vec3> &vertices, std::vector<int> &indices) {
+    const char *w, *we;
+    if (!next_word(s, e, w, we) || *w == '#')
+        return true;
+    if (we - w == 1 && *w == 'v') {
+        float c[3];
+        for (int k = 0; k < 3; k++) {
+            if (!next_word(s, e, w, we) || !parse_float(w, we, c[k]))
+                return error("expected a vertex position");
+        }
+        vertices.push_back(vec3(c[0], c[1], c[2]));
+    }
+    else if (we - w == 1 && *w == 'f') {
+        face.clear();
+        while (next_word(s, e, w, we)) {
+            // Only the position index before any '/'
+            const char *slash = w;
+            while (slash < we && *slash != '/')
+                slash++;
+            int index;
+            if (!parse_int(w, slash, index) || index == 0)
+                return error("expected a vertex index");
+            // Negative indices count back from the last vertex
+            index = index > 0 ? index - 1 : int(vertices.size()) + index;
+            if (index < 0 || index >= int(vertices.size()))
+                return error("vertex index out of range");
+            face.push_back(index);
+        }
+        if (face.size() < 3)
+            return error("a face needs three vertices");
+        for (size_t k = 2; k < face.size(); k++) {
+            indices.push_back(face[0]);
+            indices.push_back(face[k-1]);
+            indices.push_back(face[k]);
+        }
+    }
+    // Normals, texture coordinates, groups and materials are not used
+    return true;
+}
+
+bool obj_loader::load(std::vector<vec3> &vertices, std::vector<int> &indices, size_t &bytes) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    const size_t buffer_size = 1 << 22;
+    std::unique_ptr<char[]> buffer(new char[buffer_size]);
+    size_t kept = 0;
+    bytes = 0;
+    bool ok = true;
+    for (;;) {
+        size_t n = fread(buffer.get() + kept, 1, buffer_size - kept, f);
+        bytes += n;
+        size_t filled = kept + n;
+        bool last = n == 0 || filled < buffer_size;
+        const char *s = buffer.get(), *end = buffer.get() + filled;
+        while (s < end) {
+            const char *eol = static_cast<const char*>(memchr(s, '\n', end - s));
+            if (!eol) {
+                if (!last)
+                    break;
+                eol = end;
+            }
+            line++;
+            if (!parse_line(s, eol, vertices, indices)) {
+                ok = false;
+                break;
+            }
+            s = eol < end ? eol + 1 : end;
+        }
+        if (!ok || last)
+            break;
+        kept = end - s;
+        if (kept == buffer_size) {
+            ok = error("line too long");
+            break;
+        }
+        memmove(buffer.get(), s, kept);
+    }
+    if (ferror(f))
+        ok = error("read error");
+    fclose(f);
+    return ok;
+}
+
+// Load an OBJ file as a mesh of material m, or nullptr if it cannot be read
+triangle_mesh *load_obj(const char *path, material *m) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<vec3> vertices;
+    std::vector<int> indices;
+    size_t bytes;
+    obj_loader loader(path);
+    if (!loader.load(vertices, indices, bytes))
+        return nullptr;
+    if (indices.empty()) {
+        fprintf(stderr, "%s has no faces\n", path);
+        return nullptr;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t n_vertices = vertices.size(), n_triangles = indices.size() / 3;
+    fprintf(stderr, "Loaded %s: %zu vertices, %zu triangles, %.1f MB in %.1f ms (%.0f MB/s)\n",
+            path, n_vertices, n_triangles, bytes / 1048576.0, seconds * 1e3, bytes / 1048576.0 / seconds);
+
+    triangle_mesh *mesh = new triangle_mesh(vertices, indices, m);
+    // Absolute, so a scene written elsewhere still finds the file
+    char resolved[PATH_MAX];
+    mesh->source = realpath(path, resolved) ? resolved : path;
+    print_bvh_stats("mesh bvh", mesh->stats);
+    return mesh;
+}
+
+#endif
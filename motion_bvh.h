@@ -0,0 +1,313 @@
+#ifndef MOTIONBVHH
+#define MOTIONBVHH
+
+#include <vector>
+#include <cassert>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+#include "hittable.h"
+#include "bvh_build.h"
+
+// A BVH for motion blur. Every node stores its bounds at both ends of its
+// time interval, and a ray tests the box interpolated at the ray's time,
+// so a moving primitive costs only its extent at that moment instead of
+// the box swept over the whole shutter.
+// Interpolating the bounds of the children is conservative as long as
+// every primitive's box moves linearly in time, which holds for spheres,
+// moving spheres, meshes and instances of them.
+// Where primitives move in different directions the interpolated bounds of
+// a node are still loose in the middle of its interval. Such nodes are
+// split in time instead of space: both children hold all the primitives,
+// one for the first half of the interval and one for the second, and a
+// ray only visits the half that contains its time
+const uint8_t motion_bvh_temporal = 1;
+// Time intervals are never split below 1/16 of the shutter
+const int motion_bvh_max_temporal_depth = 4;
+
+struct motion_bvh_node {
+    aabb box0, box1;
+    // The node covers [time0, time0 + 1 / inv_duration]
+    float time0, inv_duration;
+    union {
+        int first_prim;
+        int second_child;
+    };
+    uint16_t n_prims;
+    uint8_t axis;
+    uint8_t flags;
+};
+
+static_assert(sizeof(motion_bvh_node) == 64, "motion_bvh_node should be 64 bytes");
+
+inline aabb lerp_box(const aabb &a, const aabb &b, float s) {
+    return aabb(a.min() + s*(b.min() - a.min()), a.max() + s*(b.max() - a.max()));
+}
+
+// The area of a box moving linearly from a to b, averaged over the move.
+// Each edge is linear in time, so the integral is exact
+float mean_motion_area(const aabb &a, const aabb &b) {
+    vec3 d0 = a.max() - a.min(), d1 = b.max() - b.min(), dd = d1 - d0;
+    float sum = 0;
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        sum += d0[i]*d0[j] + 0.5f*(d0[i]*dd[j] + d0[j]*dd[i]) + dd[i]*dd[j] / 3;
+    }
+    return 2 * sum;
+}
+
+class motion_bvh : public hittable {
+    public:
+        // The tree covers the shutter [time0, time1]
+        motion_bvh(hittable **l, int n, float time0, float time1);
+
+        virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb &box) const;
+
+        std::vector<motion_bvh_node> nodes;
+        // Primitives in leaf order. A primitive under a temporal split
+        // appears once for each half
+        std::vector<hittable*> prims;
+        bvh_stats stats;
+        int temporal_splits;
+
+    private:
+        struct prim_info {
+            aabb box0, box1;
+        };
+
+        int build(int start, int end, float t0, float t1, int temporal_depth, int depth, float root_area);
+        aabb box_at(int ref, float t) const;
+
+        hittable **list;
+        std::vector<prim_info> info;
+        // Indices into list of the primitives being built
+        std::vector<int> refs;
+        float shutter0, inv_shutter;
+};
+
+motion_bvh::motion_bvh(hittable **l, int n, float time0, float time1)
+    : temporal_splits(0), list(l), shutter0(time0), inv_shutter(time1 > time0 ? 1 / (time1 - time0) : 0) {
+    auto start = std::chrono::steady_clock::now();
+    info.resize(n);
+    refs.resize(n);
+    for (int i = 0; i < n; i++) {
+        if (!l[i]->bounding_box(time0, time0, info[i].box0) || !l[i]->bounding_box(time1, time1, info[i].box1))
+            std::cerr << "no bounding box in motion_bvh constructor\n";
+        refs[i] = i;
+    }
+    stats = bvh_stats();
+    stats.primitives = n;
+    stats.build_threads = 1;
+    stats.bounds_ms = ms_since(start);
+    auto tree_start = std::chrono::steady_clock::now();
+    if (n > 0) {
+        aabb b0 = empty_box(), b1 = empty_box();
+        for (int i = 0; i < n; i++) {
+            b0 = surrounding_box(b0, info[i].box0);
+            b1 = surrounding_box(b1, info[i].box1);
+        }
+        build(0, n, time0, time1, 0, 1, mean_motion_area(b0, b1));
+    }
+    info = std::vector<prim_info>();
+    refs = std::vector<int>();
+    stats.tree_ms = ms_since(tree_start);
+    stats.nodes = int(nodes.size());
+    stats.bytes = nodes.size() * sizeof(motion_bvh_node) + prims.size() * sizeof(hittable*);
+    stats.build_ms = ms_since(start);
+}
+
+aabb motion_bvh::box_at(int ref, float t) const {
+    return lerp_box(info[ref].box0, info[ref].box1, (t - shutter0) * inv_shutter);
+}
+
+// Binned SAH as in bvh_builder, with each box's area averaged over the
+// node's interval. Centroids are taken in the middle of the interval
+int motion_bvh::build(int start, int end, float t0, float t1, int temporal_depth, int depth, float root_area) {
+    int index = int(nodes.size());
+    nodes.push_back(motion_bvh_node());
+    float tm = 0.5f * (t0 + t1);
+    aabb b0 = empty_box(), bm = empty_box(), b1 = empty_box(), centroids = empty_box();
+    for (int i = start; i < end; i++) {
+        aabb a = box_at(refs[i], t0), m = box_at(refs[i], tm), b = box_at(refs[i], t1);
+        b0 = surrounding_box(b0, a);
+        bm = surrounding_box(bm, m);
+        b1 = surrounding_box(b1, b);
+        centroids = surrounding_box(centroids, m.centroid());
+    }
+    nodes[index].box0 = b0;
+    nodes[index].box1 = b1;
+    nodes[index].time0 = t0;
+    nodes[index].inv_duration = t1 > t0 ? 1 / (t1 - t0) : 0;
+    nodes[index].axis = 0;
+    nodes[index].flags = 0;
+
+    int n = end - start;
+    float area = mean_motion_area(b0, b1);
+    float inv_area = area > 0 ? 1 / area : 0;
+    float best_cost = MAXFLOAT;
+    int best_axis = -1, best_bin = 0;
+    vec3 extent = centroids.max() - centroids.min();
+    for (int axis = 0; axis < 3 && n > 1; axis++) {
+        if (extent[axis] <= 0)
+            continue;
+        int counts[sah_bins] = {0};
+        aabb bins0[sah_bins], bins1[sah_bins];
+        for (int b = 0; b < sah_bins; b++)
+            bins0[b] = bins1[b] = empty_box();
+        float scale = sah_bins / extent[axis];
+        for (int i = start; i < end; i++) {
+            int b = int((box_at(refs[i], tm).centroid()[axis] - centroids.min()[axis]) * scale);
+            b = b >= sah_bins ? sah_bins - 1 : b;
+            counts[b]++;
+            bins0[b] = surrounding_box(bins0[b], box_at(refs[i], t0));
+            bins1[b] = surrounding_box(bins1[b], box_at(refs[i], t1));
+        }
+        float right_area[sah_bins];
+        int right_count[sah_bins];
+        aabb acc0 = empty_box(), acc1 = empty_box();
+        int count = 0;
+        for (int b = sah_bins - 1; b > 0; b--) {
+            acc0 = surrounding_box(acc0, bins0[b]);
+            acc1 = surrounding_box(acc1, bins1[b]);
+            count += counts[b];
+            right_area[b] = count ? mean_motion_area(acc0, acc1) : 0;
+            right_count[b] = count;
+        }
+        acc0 = acc1 = empty_box();
+        count = 0;
+        for (int b = 0; b < sah_bins - 1; b++) {
+            acc0 = surrounding_box(acc0, bins0[b]);
+            acc1 = surrounding_box(acc1, bins1[b]);
+            count += counts[b];
+            if (count == 0 || right_count[b+1] == 0)
+                continue;
+            float cost = sah_traversal_cost + inv_area * sah_intersect_cost *
+                         (count * mean_motion_area(acc0, acc1) + right_count[b+1] * right_area[b+1]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    // Half the rays see each half of the interval
+    float temporal_cost = MAXFLOAT;
+    if (n > 1 && temporal_depth < motion_bvh_max_temporal_depth)
+        temporal_cost = sah_traversal_cost + inv_area * sah_intersect_cost * n *
+                        0.5f * (mean_motion_area(b0, bm) + mean_motion_area(bm, b1));
+
+    float leaf = sah_intersect_cost * n;
+    // Like bvh_builder, nodes of more than 4 primitives are always split,
+    // at the median if they are too deep or neither split in space nor
+    // worth splitting in time
+    bool median = n > 4 && (depth >= sah_max_depth || (best_axis < 0 && !(temporal_cost < leaf)));
+    bool can_split = best_axis >= 0 || temporal_cost < MAXFLOAT;
+    bool make_leaf = !median && (!can_split || (leaf <= best_cost && leaf <= temporal_cost && (n <= 4 || best_axis < 0)));
+    stats.max_depth = std::max(stats.max_depth, depth);
+    if (make_leaf) {
+        assert(n <= UINT16_MAX);
+        nodes[index].first_prim = int(prims.size());
+        nodes[index].n_prims = uint16_t(n);
+        for (int i = start; i < end; i++)
+            prims.push_back(list[refs[i]]);
+        stats.leaves++;
+        stats.sah_cost += (root_area > 0 ? area / root_area : 1) * leaf;
+        return index;
+    }
+    stats.sah_cost += (root_area > 0 ? area / root_area : 1) * sah_traversal_cost;
+
+    nodes[index].n_prims = 0;
+    if (median) {
+        int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+        int split = start + n / 2;
+        std::nth_element(&refs[start], &refs[split], &refs[end - 1] + 1, [&](int a, int b) {
+            return box_at(a, tm).centroid()[axis] < box_at(b, tm).centroid()[axis];
+        });
+        nodes[index].axis = uint8_t(axis);
+        build(start, split, t0, t1, temporal_depth, depth + 1, root_area);
+        int second = build(split, end, t0, t1, temporal_depth, depth + 1, root_area);
+        nodes[index].second_child = second;
+        return index;
+    }
+    if (temporal_cost < best_cost) {
+        // Both halves build over the same primitives. The first half only
+        // reorders the range, which the second does not mind
+        nodes[index].flags = motion_bvh_temporal;
+        temporal_splits++;
+        build(start, end, t0, tm, temporal_depth + 1, depth + 1, root_area);
+        int second = build(start, end, tm, t1, temporal_depth + 1, depth + 1, root_area);
+        nodes[index].second_child = second;
+        return index;
+    }
+
+    float cmin = centroids.min()[best_axis];
+    float scale = sah_bins / extent[best_axis];
+    int *mid = std::partition(&refs[start], &refs[end - 1] + 1, [&](int ref) {
+        int b = int((box_at(ref, tm).centroid()[best_axis] - cmin) * scale);
+        b = b >= sah_bins ? sah_bins - 1 : b;
+        return b <= best_bin;
+    });
+    int split = int(mid - &refs[0]);
+    nodes[index].axis = uint8_t(best_axis);
+    build(start, split, t0, t1, temporal_depth, depth + 1, root_area);
+    int second = build(split, end, t0, t1, temporal_depth, depth + 1, root_area);
+    nodes[index].second_child = second;
+    return index;
+}
+
+bool motion_bvh::bounding_box(float t0, float t1, aabb &b) const {
+    if (nodes.empty())
+        return false;
+    b = surrounding_box(nodes[0].box0, nodes[0].box1);
+    return true;
+}
+
+bool motion_bvh::hit(const ray &r, float t_min, float t_max, hit_record &rec) const {
+    if (nodes.empty())
+        return false;
+    box_ray br(r);
+    float time = r.time();
+    int stack[bvh_stack_size];
+    int stack_size = 0;
+    int current = 0;
+    bool hit_anything = false;
+    for (;;) {
+        const motion_bvh_node &node = nodes[current];
+        // Rays outside the shutter see the bounds at its nearest end
+        float s = (time - node.time0) * node.inv_duration;
+        s = s < 0 ? 0 : s > 1 ? 1 : s;
+        if (lerp_box(node.box0, node.box1, s).hit(br, t_min, t_max)) {
+            if (node.n_prims > 0) {
+                for (int i = 0; i < node.n_prims; i++) {
+                    if (prims[node.first_prim + i]->hit(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                }
+            }
+            else if (node.flags & motion_bvh_temporal) {
+                // Only the half holding the ray's time
+                current = time < nodes[node.second_child].time0 ? current + 1 : node.second_child;
+                continue;
+            }
+            else if (br.sign[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.second_child;
+                continue;
+            }
+            else {
+                stack[stack_size++] = node.second_child;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+    return hit_anything;
+}
+
+#endif
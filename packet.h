@@ -0,0 +1,24 @@
+#ifndef PACKETH
+#define PACKETH
+
+#include "ray.h"
+#include "hittable.h"
+
+// Primary rays for a packet_width by packet_width block of pixels. They
+// leave the camera in nearly the same direction, so a packet walks the
+// BVH once instead of once per ray
+const int packet_width = 4;
+const int packet_size = packet_width * packet_width;
+
+struct ray_packet {
+    ray rays[packet_size];
+    // Blocks at the edge of a tile may hold fewer rays
+    int count;
+};
+
+struct packet_hits {
+    hit_record rec[packet_size];
+    bool hit[packet_size];
+};
+
+#endif
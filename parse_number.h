@@ -0,0 +1,85 @@
+#ifndef PARSENUMBERH
+#define PARSENUMBERH
+
+#include <cstdlib>
+#include <string>
+#include <stdint.h>
+
+// Number parsing for the text loaders. Decimal numbers are assembled from
+// their digits directly, which is much faster than strtof. Up to 19
+// significant digits are kept. The whole range [s, e) must be the number
+bool parse_float(const char *s, const char *e, float &f) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *start = s;
+    bool negative = false;
+    if (s < e && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; s < e && *s >= '0' && *s <= '9'; s++, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            digits += mantissa > 0;
+        }
+        else
+            exponent++;
+    }
+    if (s < e && *s == '.') {
+        for (s++; s < e && *s >= '0' && *s <= '9'; s++, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                digits += mantissa > 0;
+                exponent--;
+            }
+        }
+    }
+    if (any && s < e && (*s == 'e' || *s == 'E')) {
+        s++;
+        bool negative_exponent = false;
+        if (s < e && (*s == '-' || *s == '+'))
+            negative_exponent = *s++ == '-';
+        // strtod would leave "1e" unparsed, so an exponent needs digits
+        if (s == e || *s < '0' || *s > '9')
+            return false;
+        int x = 0;
+        for (; s < e && *s >= '0' && *s <= '9'; s++)
+            x = x < 10000 ? x * 10 + (*s - '0') : x;
+        exponent += negative_exponent ? -x : x;
+    }
+    if (!any || s != e)
+        return false;
+
+    double v = double(mantissa);
+    if (exponent >= -22 && exponent <= 22)
+        v = exponent < 0 ? v / powers[-exponent] : v * powers[exponent];
+    else
+        v = strtod(std::string(start, e).c_str(), nullptr);
+    f = float(negative ? -v : v);
+    return true;
+}
+
+// A decimal integer, with an optional sign
+bool parse_int(const char *s, const char *e, int &n) {
+    bool negative = false;
+    if (s < e && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+    if (s == e)
+        return false;
+    long long v = 0;
+    for (; s < e; s++) {
+        if (*s < '0' || *s > '9' || v > 1000000000000LL)
+            return false;
+        v = v * 10 + (*s - '0');
+    }
+    v = negative ? -v : v;
+    if (v < -2147483647LL || v > 2147483647LL)
+        return false;
+    n = int(v);
+    return true;
+}
+
+#endif
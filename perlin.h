@@ -2,11 +2,7 @@
 #define PERLINH
 
 #include "vec3.h"
-#include <cstdlib>
-
-inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
-}
+#include "random.h"
 
 inline float perlin_interp(vec3 c[2][2][2], float u, float v, float w) {
     float uu = u*u*(3-2*u);
@@ -57,12 +53,16 @@ class perlin {
         static int *perm_z;
 };
 
+// The tables are built once from a fixed seed so every run,
+// and every thread, sees the same noise
+static rng perlin_rng(0x5eed, 0x9e71);
+
 static vec3* perlin_generate() {
     vec3 *p = new vec3[256];
     for (int i = 0; i < 256; ++i) {
-        double x_random = 2*random_double() - 1;
-        double y_random = 2*random_double() - 1;
-        double z_random = 2*random_double() - 1;
+        double x_random = 2*perlin_rng.next_float() - 1;
+        double y_random = 2*perlin_rng.next_float() - 1;
+        double z_random = 2*perlin_rng.next_float() - 1;
         p[i] = unit_vector(vec3(x_random, y_random, z_random));
     }
     return p;
@@ -70,7 +70,7 @@ static vec3* perlin_generate() {
 
 void permute(int *p, int n) {
     for (int i = n-1; i > 0; i--) {
-        int target = int(random_double()*(i+1));
+        int target = int(perlin_rng.next_float()*(i+1));
         int tmp = p[i];
         p[i] = p[target];
         p[target] = tmp;
@@ -0,0 +1,43 @@
+#ifndef PLANEH
+#define PLANEH
+
+#include "vec3.h"
+#include "hittable.h"
+
+// An infinite plane through point, facing along normal. It has no bounding
+// box, so it is never put in a BVH but tested on its own next to it
+class plane: public hittable {
+    public:
+        plane() {}
+        plane(vec3 p, vec3 n, material *m) : point(p), normal(unit_vector(n)), mat_ptr(m) {};
+
+        virtual bool hit(const ray &r, float tmin, float tmax, hit_record &rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb &box) const;
+        vec3 point;
+        vec3 normal;
+        material *mat_ptr;
+};
+
+// Points p on the plane satisfy dot(p - point, normal) = 0, so a ray
+// A + t*B meets it at t = dot(point - A, normal) / dot(B, normal). Rays
+// parallel to the plane miss it
+bool plane::hit(const ray &r, float t_min, float t_max, hit_record &rec) const {
+    float denom = dot(r.direction(), normal);
+    if (denom == 0)
+        return false;
+    float t = dot(point - r.origin(), normal) / denom;
+    if (t < t_max && t > t_min) {
+        rec.t = t;
+        rec.p = r.point_at_parameter(t);
+        rec.normal = normal;
+        rec.mat_ptr = mat_ptr;
+        return true;
+    }
+    return false;
+}
+
+bool plane::bounding_box(float t0, float t1, aabb &box) const {
+    return false;
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef PROGRESSIVEH
+#define PROGRESSIVEH
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "render.h"
+#include "framebuffer.h"
+
+// Progressive rendering: the image is refined by passes that each add a few
+// samples to every pixel. The running sums and sample counts can be saved
+// to a checkpoint file and loaded again to carry on with more passes.
+// Sample s of a pixel always draws from pixel_rng(i, j, nx, s), so the
+// sample counts are all the random number state there is to save, and a
+// resumed render gives the same image as one that was never stopped
+
+// Sums of the samples taken so far and their count, for every pixel
+class accumulator {
+    public:
+        accumulator(int x, int y) : nx(x), ny(y), sum(x*y, vec3(0, 0, 0)), samples(x*y, 0) {}
+
+        // Write the mean of every pixel into fb
+        void resolve(framebuffer &fb) const;
+        // The key identifies what was rendered. A checkpoint is only loaded
+        // by a render with the same key and size
+        bool save(const char *path, uint64_t key) const;
+        bool load(const char *path, uint64_t key);
+        long long total_samples() const;
+
+        int nx, ny;
+        std::vector<vec3> sum;
+        std::vector<int> samples;
+};
+
+// Checkpoint layout: magic, version, key, nx, ny, then nx*ny sums of three
+// floats and nx*ny sample counts, in native byte order
+const char checkpoint_magic[8] = { 'r', 't', 'a', 'c', 'c', 'u', 'm', '\n' };
+const uint32_t checkpoint_version = 1;
+
+void accumulator::resolve(framebuffer &fb) const {
+    for (size_t i = 0; i < sum.size(); i++) {
+        fb.pixels[i] = samples[i] > 0 ? sum[i] / float(samples[i]) : vec3(0, 0, 0);
+        fb.samples[i] = samples[i];
+    }
+}
+
+long long accumulator::total_samples() const {
+    long long total = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+        total += samples[i];
+    return total;
+}
+
+// The checkpoint is written next to path and renamed over it, so a crash
+// while saving leaves the previous checkpoint in place
+bool accumulator::save(const char *path, uint64_t key) const {
+    std::string temp = std::string(path) + ".tmp";
+    FILE *f = fopen(temp.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "cannot write checkpoint %s\n", temp.c_str());
+        return false;
+    }
+    int32_t size[2] = { nx, ny };
+    bool ok = fwrite(checkpoint_magic, sizeof(checkpoint_magic), 1, f) == 1 &&
+              fwrite(&checkpoint_version, sizeof(checkpoint_version), 1, f) == 1 &&
+              fwrite(&key, sizeof(key), 1, f) == 1 &&
+              fwrite(size, sizeof(size), 1, f) == 1 &&
+              fwrite(sum.data(), sizeof(vec3), sum.size(), f) == sum.size() &&
+              fwrite(samples.data(), sizeof(int), samples.size(), f) == samples.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path) != 0) {
+        fprintf(stderr, "cannot write checkpoint %s\n", path);
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool accumulator::load(const char *path, uint64_t key) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open checkpoint %s\n", path);
+        return false;
+    }
+    char magic[sizeof(checkpoint_magic)];
+    uint32_t version;
+    uint64_t file_key;
+    int32_t size[2];
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+              memcmp(magic, checkpoint_magic, sizeof(magic)) == 0 &&
+              fread(&version, sizeof(version), 1, f) == 1 && version == checkpoint_version &&
+              fread(&file_key, sizeof(file_key), 1, f) == 1 &&
+              fread(size, sizeof(size), 1, f) == 1;
+    if (!ok)
+        fprintf(stderr, "%s is not a checkpoint\n", path);
+    else if (file_key != key || size[0] != nx || size[1] != ny) {
+        fprintf(stderr, "checkpoint %s is of a different render\n", path);
+        ok = false;
+    }
+    else {
+        std::vector<vec3> file_sum(sum.size());
+        std::vector<int> file_samples(samples.size());
+        ok = fread(file_sum.data(), sizeof(vec3), file_sum.size(), f) == file_sum.size() &&
+             fread(file_samples.data(), sizeof(int), file_samples.size(), f) == file_samples.size();
+        if (ok) {
+            sum.swap(file_sum);
+            samples.swap(file_samples);
+        }
+        else
+            fprintf(stderr, "checkpoint %s is truncated\n", path);
+    }
+    fclose(f);
+    return ok;
+}
+
+// Add spp samples to every pixel of acc, continuing each pixel's sample
+// sequence where it stopped
+render_stats render_pass(const render_settings &settings, hittable *world, camera &cam,
+                         tile_scheduler &scheduler, accumulator &acc, int spp) {
+    render_stats stats = render_tiles(settings, scheduler, [&](int worker, const tile &t) {
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                int p = j*acc.nx + i;
+                int first = acc.samples[p];
+                for (int s = first; s < first + spp; s++)
+                    acc.sum[p] += sample_pixel(i, j, s, settings, world, cam);
+                acc.samples[p] += spp;
+            }
+        }
+    });
+    stats.samples = (long long)spp * acc.nx * acc.ny;
+    return stats;
+}
+
+#endif
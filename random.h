@@ -1,10 +1,56 @@
 #ifndef RANDOMH
 #define RANDOMH
 
-#include <cstdlib>
+#include <stdint.h>
 
-double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+// A small PCG32 generator (O'Neill, pcg-random.org).
+// Every sample owns its own rng which is passed explicitly through the
+// sampling code, so there is no hidden global state shared between threads
+// and an image does not depend on the thread count or the tile order
+class rng {
+    public:
+        rng(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+            set_seed(seed, stream);
+        }
+
+        void set_seed(uint64_t seed, uint64_t stream) {
+            state = 0;
+            inc = (stream << 1) | 1;
+            next_uint();
+            state += seed;
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            uint64_t old = state;
+            state = old * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+            uint32_t rot = uint32_t(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+        }
+
+        // Uniform float in [0, 1). Only 24 bits fit in the mantissa
+        float next_float() {
+            return float(next_uint() >> 8) * (1.0f / 16777216.0f);
+        }
+
+        uint64_t state;
+        uint64_t inc;
+};
+
+// SplitMix64 finalizer. Turns consecutive pixel and sample indices into
+// well spread seeds
+inline uint64_t mix_seed(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// The generator for sample s of pixel (i, j) of a nx wide image
+inline rng pixel_rng(int i, int j, int nx, int s) {
+    uint64_t pixel = uint64_t(j) * uint64_t(nx) + uint64_t(i);
+    return rng(mix_seed(pixel ^ mix_seed(uint64_t(s))), pixel);
 }
 
 #endif
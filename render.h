@@ -0,0 +1,217 @@
+#ifndef RENDERH
+#define RENDERH
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include "camera.h"
+#include "linear_bvh.h"
+#include "framebuffer.h"
+#include "tile_scheduler.h"
+#include "integrator.h"
+#include "wavefront.h"
+
+// How a frame is rendered. Packets need the world to be a linear_bvh
+// and one of the per-ray integrators
+struct render_settings {
+    int nx, ny;
+    int ns;
+    int tile_size = 16;
+    bool packets = false;
+    integrator_kind integrator = iterative_kind;
+    path_options path;
+    // Adaptive sampling. With a threshold above 0 every pixel takes min_spp
+    // samples, then more until the standard error of its mean luminance is
+    // below threshold times that mean, or it has taken max_spp samples
+    float adaptive_threshold = 0;
+    int min_spp = 16;
+    int max_spp = 64;
+};
+
+struct render_stats {
+    long long rays;
+    // Camera paths, the sum of the samples of all pixels
+    long long samples;
+    double seconds;
+};
+
+// Whether n samples with the given running mean and sum of squared
+// deviations from it are enough. Pixels darker than 0.01 are held to that
+// absolute level so black areas do not take every sample
+bool converged(int n, float mean, float m2, float threshold) {
+    float variance = m2 / (n - 1);
+    return sqrt(variance / n) <= threshold * ffmax(mean, 0.01);
+}
+
+// Sample s of pixel (i, j). Every sample draws from its own stream, seeded
+// by the pixel and sample index, so a sample is the same however the
+// samples of a pixel are split between passes or threads
+vec3 sample_pixel(int i, int j, int s, const render_settings &settings, hittable *world, camera &cam) {
+    rng random = pixel_rng(i, j, settings.nx, s);
+    float u = float(i + random.next_float()) / float(settings.nx);
+    float v = float(j + random.next_float()) / float(settings.ny);
+    ray r = cam.get_ray(u, v, random);
+    if (settings.integrator == recursive_kind)
+        return color(r, world, 0, settings.path, random);
+    else
+        return trace_path(r, world, settings.path, random);
+}
+
+// Multisample Antialiasing (MSAA)
+// Send ns samples through each pixel, with the direction of each
+// ray slightly randomized. The pixel takes the average color of
+// these sample rays. This blends the foreground and background on
+// edge pixels.
+void render_tile(const tile &t, const render_settings &settings, hittable *world, camera &cam, framebuffer &fb) {
+    bool adaptive = settings.adaptive_threshold > 0;
+    int ns = adaptive ? settings.max_spp : settings.ns;
+    for (int j = t.y0; j < t.y1; j++) {
+        for (int i = t.x0; i < t.x1; i++) {
+            vec3 col(0, 0, 0);
+            // Running mean and squared deviation of the sample luminance
+            float mean = 0, m2 = 0;
+            int s;
+            for (s=0; s < ns; s++) {
+                if (adaptive && s >= settings.min_spp && converged(s, mean, m2, settings.adaptive_threshold))
+                    break;
+                vec3 sample = sample_pixel(i, j, s, settings, world, cam);
+                col += sample;
+
+                float y = (sample.x() + sample.y() + sample.z()) / 3;
+                float delta = y - mean;
+                mean += delta / (s + 1);
+                m2 += delta * (y - mean);
+            }
+
+            col /= float(s);
+            fb.at(i, j) = col;
+            fb.samples_at(i, j) = s;
+        }
+    }
+}
+
+// Trace primary rays for packet_width by packet_width blocks of
+// pixels together. Bounces go on one ray at a time
+void render_tile_packets(const tile &t, const render_settings &settings, linear_bvh *world, camera &cam, framebuffer &fb) {
+    int nx = settings.nx, ny = settings.ny, ns = settings.ns;
+    for (int y = t.y0; y < t.y1; y += packet_width) {
+        for (int x = t.x0; x < t.x1; x += packet_width) {
+            int px[packet_size], py[packet_size];
+            int n = 0;
+            for (int j = y; j < y + packet_width && j < t.y1; j++) {
+                for (int i = x; i < x + packet_width && i < t.x1; i++) {
+                    px[n] = i;
+                    py[n] = j;
+                    n++;
+                }
+            }
+
+            vec3 col[packet_size];
+            for (int k = 0; k < n; k++)
+                col[k] = vec3(0, 0, 0);
+            for (int s = 0; s < ns; s++) {
+                rng random[packet_size];
+                float u[packet_size] = {}, v[packet_size] = {};
+                for (int k = 0; k < n; k++) {
+                    random[k] = pixel_rng(px[k], py[k], nx, s);
+                    u[k] = float(px[k] + random[k].next_float()) / float(nx);
+                    v[k] = float(py[k] + random[k].next_float()) / float(ny);
+                }
+                ray_packet packet;
+                packet.count = n;
+                cam.get_packet(u, v, random, n, packet.rays);
+                packet_hits hits;
+                world->hit_packet(packet, 0.001, MAXFLOAT, hits);
+                for (int k = 0; k < n; k++) {
+                    if (settings.integrator == recursive_kind)
+                        col[k] += shade(packet.rays[k], hits.hit[k], hits.rec[k], world, 0, settings.path, random[k]);
+                    else
+                        col[k] += trace_path(packet.rays[k], hits.hit[k], hits.rec[k], world, settings.path, random[k]);
+                }
+            }
+            for (int k = 0; k < n; k++) {
+                col[k] /= float(ns);
+                fb.at(px[k], py[k]) = col[k];
+                fb.samples_at(px[k], py[k]) = ns;
+            }
+        }
+    }
+}
+
+// Run job on each of the tiles on every worker of the scheduler, counting
+// the rays traced and showing progress.
+// The samples of the returned stats are left to the caller
+render_stats render_tiles(const render_settings &settings, tile_scheduler &scheduler,
+                          const std::vector<tile> &tiles, const tile_scheduler::tile_job &job) {
+    std::atomic<int> tiles_done(0);
+    std::atomic<long long> total_rays(0);
+    std::mutex progress_mutex;
+
+    auto start = std::chrono::steady_clock::now();
+    scheduler.run(tiles, [&](int worker, const tile &t) {
+        job(worker, t);
+
+        total_rays += rays_traced;
+        rays_traced = 0;
+
+        // Display rendering progress in console as a percentage
+        int done = ++tiles_done;
+        if (progress_mutex.try_lock()) {
+            fprintf(stderr,"\rRendering (%dx%d) %5.2f%%", settings.nx, settings.ny, double(100.0*done/tiles.size()));
+            progress_mutex.unlock();
+        }
+    });
+
+    render_stats stats;
+    stats.rays = total_rays.load();
+    stats.samples = 0;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr,"\rRendering (%dx%d) %5.2f%% on %d threads\n", settings.nx, settings.ny, 100.0, scheduler.size());
+    return stats;
+}
+
+// The same over the tiles of the whole canvas
+render_stats render_tiles(const render_settings &settings, tile_scheduler &scheduler,
+                          const tile_scheduler::tile_job &job) {
+    return render_tiles(settings, scheduler, make_tiles(settings.nx, settings.ny, settings.tile_size), job);
+}
+
+// Render views of one world, view k through cams[k] into fbs[k]. The
+// tiles of every view go to the scheduler together, so workers that run
+// out of one view's tiles go on with another's instead of waiting for the
+// view to finish. Each pixel is written to its framebuffer exactly once
+render_stats render_views(const render_settings &settings, hittable *world, const std::vector<camera*> &cams,
+                          tile_scheduler &scheduler, const std::vector<framebuffer*> &fbs) {
+    linear_bvh *packet_bvh = dynamic_cast<linear_bvh*>(world);
+    // Each worker keeps its own path pool between tiles
+    std::vector<wavefront_integrator> wavefronts(scheduler.size(), wavefront_integrator(world, settings.path));
+
+    std::vector<tile> tiles;
+    for (size_t k = 0; k < cams.size(); k++)
+        make_tiles(settings.nx, settings.ny, settings.tile_size, int(k), tiles);
+    render_stats stats = render_tiles(settings, scheduler, tiles, [&](int worker, const tile &t) {
+        camera &cam = *cams[t.image];
+        framebuffer &fb = *fbs[t.image];
+        if (settings.integrator == wavefront_kind)
+            rays_traced += wavefronts[worker].render_tile(t, cam, settings.nx, settings.ny, settings.ns, fb);
+        else if (settings.packets && packet_bvh)
+            render_tile_packets(t, settings, packet_bvh, cam, fb);
+        else
+            render_tile(t, settings, world, cam, fb);
+    });
+    for (size_t k = 0; k < fbs.size(); k++) {
+        for (size_t i = 0; i < fbs[k]->samples.size(); i++)
+            stats.samples += fbs[k]->samples[i];
+    }
+    return stats;
+}
+
+// Render the frame
+render_stats render(const render_settings &settings, hittable *world, camera &cam,
+                    tile_scheduler &scheduler, framebuffer &fb) {
+    return render_views(settings, world, std::vector<camera*>(1, &cam), scheduler, std::vector<framebuffer*>(1, &fb));
+}
+
+#endif
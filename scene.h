@@ -0,0 +1,854 @@
+#ifndef SCENEH
+#define SCENEH
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <sys/resource.h>
+#include "arena.h"
+#include "parse_number.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "plane.h"
+#include "mesh.h"
+#include "instance.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "texture.h"
+#include "hittable_list.h"
+#include "random.h"
+
+// Scene files are plain text, one statement per line. '#' starts a comment.
+//
+//   image WIDTH HEIGHT SAMPLES
+//   camera [lookfrom X Y Z] [lookat X Y Z] [vup X Y Z] [vfov DEGREES]
+//          [aperture A] [focus DISTANCE] [shutter T0 T1]
+//   keyframe FRAME [CAMERA SETTINGS]   (the camera at FRAME of a sequence)
+//   view OUTPUT [CAMERA SETTINGS]      (one view of a batch, see below)
+//   texture NAME TEXTURE
+//   material NAME MATERIAL
+//   sphere X Y Z RADIUS MATERIAL
+//   moving_sphere X0 Y0 Z0 X1 Y1 Z1 T0 T1 RADIUS MATERIAL
+//   plane X Y Z NX NY NZ MATERIAL   (infinite, through X Y Z facing NX NY NZ)
+//   mesh PATH MATERIAL        (a Wavefront OBJ file, relative to the scene)
+//   object NAME               (starts a shared object, a BVH over the
+//   ...                        spheres and meshes up to the end line)
+//   end
+//   instance NAME [TRANSFORM ...]
+//
+// A view renders the scene through another camera to the image file
+// OUTPUT. If a scene has views, all of them are rendered in one batch
+// instead of the camera's image. Like a keyframe, a view starts from the
+// camera line before it.
+// A keyframe starts from the camera line before it and takes the same
+// settings but the shutter, which the sequence sets for each frame.
+// Between keyframes the camera moves linearly, and before the first and
+// after the last it stays put.
+//
+// An instance places a copy of an object. Its transforms apply in the
+// order given, each one of
+//   translate X Y Z
+//   scale S                   (or scale X Y Z)
+//   rotate AXIS_X AXIS_Y AXIS_Z DEGREES
+//   matrix M00 M01 M02 M03 M10 ... M23   (a 3x4 affine matrix, by rows)
+//
+// where TEXTURE is the name of an earlier texture or one of
+//   constant R G B
+//   checker EVEN ODD          (two textures)
+//   plane_checker SIZE EVEN ODD   (squares of side SIZE in x and z)
+//   noise SCALE
+// and MATERIAL is the name of an earlier material or one of
+//   lambertian TEXTURE        (or lambertian R G B for a constant color)
+//   metal R G B FUZZ
+//   dielectric REFRACTIVE_INDEX
+
+// How the camera is placed. The defaults are the view of random_scene()
+struct camera_settings {
+    vec3 lookfrom = vec3(13, 2, 3);
+    vec3 lookat = vec3(0, 0, 0);
+    vec3 vup = vec3(0, 1, 0);
+    float vfov = 20;
+    float aperture = 0;
+    float focus_dist = 10;
+    float time0 = 0, time1 = 1;
+};
+
+struct camera_key {
+    int frame;
+    camera_settings view;
+};
+
+struct view_spec {
+    std::string output;
+    camera_settings view;
+};
+
+struct scene_description {
+    hittable_list *objects = nullptr;
+    camera_settings view;
+    // Camera keyframes of an animation, by increasing frame
+    std::vector<camera_key> keyframes;
+    // Views to render in a batch instead of view
+    std::vector<view_spec> views;
+    // Image size and samples per pixel, 0 where the file leaves them to
+    // the command line
+    int nx = 0, ny = 0, ns = 0;
+    // Hash of the scene file, 0 for a generated scene
+    uint64_t hash = 0;
+};
+
+// The camera at frame, from the keyframes or else the still camera
+camera_settings camera_at(const scene_description &s, int frame) {
+    const std::vector<camera_key> &keys = s.keyframes;
+    if (keys.empty())
+        return s.view;
+    if (frame <= keys.front().frame)
+        return keys.front().view;
+    if (frame >= keys.back().frame)
+        return keys.back().view;
+    size_t k = 1;
+    while (keys[k].frame < frame)
+        k++;
+    const camera_settings &a = keys[k-1].view, &b = keys[k].view;
+    float u = float(frame - keys[k-1].frame) / float(keys[k].frame - keys[k-1].frame);
+    camera_settings v = a;
+    v.lookfrom = a.lookfrom + u * (b.lookfrom - a.lookfrom);
+    v.lookat = a.lookat + u * (b.lookat - a.lookat);
+    v.vup = a.vup + u * (b.vup - a.vup);
+    v.vfov = a.vfov + u * (b.vfov - a.vfov);
+    v.aperture = a.aperture + u * (b.aperture - a.aperture);
+    v.focus_dist = a.focus_dist + u * (b.focus_dist - a.focus_dist);
+    return v;
+}
+
+// A fast 64 bit hash that takes 8 bytes per step. Data hashed in pieces
+// gives the same state as in one go if every piece but the last is a
+// multiple of 8 bytes long
+uint64_t hash_words(const char *data, size_t size, uint64_t h) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++) {
+        h = (h ^ uint8_t(data[i])) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+uint64_t hash_bytes(const char *data, size_t size) {
+    return mix_seed(hash_words(data, size, 0) ^ size);
+}
+
+// The hash of a file as hash_bytes() gives it, without keeping the file
+bool hash_file(const char *path, uint64_t &hash) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    std::vector<char> buffer(1 << 20);
+    uint64_t h = 0;
+    size_t total = 0, n;
+    while ((n = fread(buffer.data(), 1, buffer.size(), f)) > 0) {
+        h = hash_words(buffer.data(), n, h);
+        total += n;
+    }
+    fclose(f);
+    hash = mix_seed(h ^ total);
+    return true;
+}
+
+// Peak resident memory of the process, in MB
+double peak_memory_mb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+// A single pass parser. The file is read into memory with one read and
+// scanned once; objects are made in the arena as their lines are read
+class scene_parser {
+    public:
+        scene_parser(const char *p, arena &m) : path(p), memory(m) {}
+        bool parse(const char *data, size_t size, scene_description &out);
+
+        // Hashes of the mesh files read, which the scene's hash covers too
+        std::vector<uint64_t> file_hashes;
+
+    private:
+        struct token {
+            const char *s;
+            int n;
+            bool is(const char *word) const { return int(strlen(word)) == n && memcmp(s, word, n) == 0; }
+            std::string str() const { return std::string(s, n); }
+        };
+
+        bool next(token &t);
+        bool number(float &f);
+        bool numbers(float *f, int n);
+        bool vector(vec3 &v);
+        bool end_of_line();
+        bool error(const char *message);
+
+        texture *parse_texture();
+        material *parse_material();
+        bool parse_camera(camera_settings &view);
+        bool parse_transform(transform &to_world);
+
+        const char *path;
+        arena &memory;
+        const char *p, *end;
+        int line;
+        std::unordered_map<std::string, texture*> textures;
+        std::unordered_map<std::string, material*> materials;
+        std::unordered_map<std::string, hittable*> shared_objects;
+};
+
+bool scene_parser::error(const char *message) {
+    fprintf(stderr, "%s:%d: %s\n", path, line, message);
+    return false;
+}
+
+// The next word of the current line. Fails at the end of the line
+bool scene_parser::next(token &t) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    if (p == end || *p == '\n' || *p == '#')
+        return false;
+    t.s = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        p++;
+    t.n = int(p - t.s);
+    return true;
+}
+
+bool scene_parser::number(float &f) {
+    token t;
+    if (!next(t) || !parse_float(t.s, t.s + t.n, f))
+        return error("expected a number");
+    return true;
+}
+
+bool scene_parser::numbers(float *f, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!number(f[i]))
+            return false;
+    }
+    return true;
+}
+
+bool scene_parser::vector(vec3 &v) {
+    float f[3];
+    if (!numbers(f, 3))
+        return false;
+    v = vec3(f[0], f[1], f[2]);
+    return true;
+}
+
+// Nothing but a comment may follow a statement. Moves to the next line
+bool scene_parser::end_of_line() {
+    token t;
+    if (next(t))
+        return error("unexpected text at the end of the line");
+    while (p < end && *p != '\n')
+        p++;
+    if (p < end)
+        p++;
+    line++;
+    return true;
+}
+
+texture *scene_parser::parse_texture() {
+    token t;
+    if (!next(t)) {
+        error("expected a texture");
+        return nullptr;
+    }
+    if (t.is("constant")) {
+        vec3 c;
+        return vector(c) ? memory.make<constant_texture>(texture_memory, c) : nullptr;
+    }
+    if (t.is("checker")) {
+        texture *even = parse_texture();
+        texture *odd = even ? parse_texture() : nullptr;
+        return odd ? memory.make<checker_texture>(texture_memory, even, odd) : nullptr;
+    }
+    if (t.is("plane_checker")) {
+        float size;
+        if (!number(size))
+            return nullptr;
+        if (size <= 0) {
+            error("the squares need a positive size");
+            return nullptr;
+        }
+        texture *even = parse_texture();
+        texture *odd = even ? parse_texture() : nullptr;
+        return odd ? memory.make<plane_checker_texture>(texture_memory, even, odd, size) : nullptr;
+    }
+    if (t.is("noise")) {
+        float scale;
+        return number(scale) ? memory.make<noise_texture>(texture_memory, scale) : nullptr;
+    }
+    auto found = textures.find(t.str());
+    if (found == textures.end()) {
+        error("unknown texture");
+        return nullptr;
+    }
+    return found->second;
+}
+
+material *scene_parser::parse_material() {
+    token t;
+    if (!next(t)) {
+        error("expected a material");
+        return nullptr;
+    }
+    if (t.is("lambertian")) {
+        // A color, or a texture
+        const char *start = p;
+        token first;
+        if (next(first) && (first.s[0] == '-' || first.s[0] == '.' || (first.s[0] >= '0' && first.s[0] <= '9'))) {
+            p = start;
+            vec3 c;
+            if (!vector(c))
+                return nullptr;
+            return memory.make<lambertian>(material_memory, memory.make<constant_texture>(texture_memory, c));
+        }
+        p = start;
+        texture *albedo = parse_texture();
+        return albedo ? memory.make<lambertian>(material_memory, albedo) : nullptr;
+    }
+    if (t.is("metal")) {
+        float f[4];
+        return numbers(f, 4) ? memory.make<metal>(material_memory, vec3(f[0], f[1], f[2]), f[3]) : nullptr;
+    }
+    if (t.is("dielectric")) {
+        float ri;
+        return number(ri) ? memory.make<dielectric>(material_memory, ri) : nullptr;
+    }
+    auto found = materials.find(t.str());
+    if (found == materials.end()) {
+        error("unknown material");
+        return nullptr;
+    }
+    return found->second;
+}
+
+bool scene_parser::parse_camera(camera_settings &view) {
+    token t;
+    while (next(t)) {
+        bool ok;
+        if (t.is("lookfrom"))
+            ok = vector(view.lookfrom);
+        else if (t.is("lookat"))
+            ok = vector(view.lookat);
+        else if (t.is("vup"))
+            ok = vector(view.vup);
+        else if (t.is("vfov"))
+            ok = number(view.vfov);
+        else if (t.is("aperture"))
+            ok = number(view.aperture);
+        else if (t.is("focus"))
+            ok = number(view.focus_dist);
+        else if (t.is("shutter"))
+            ok = number(view.time0) && number(view.time1);
+        else
+            return error("unknown camera setting");
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+bool scene_parser::parse_transform(transform &to_world) {
+    token t;
+    while (next(t)) {
+        transform step;
+        if (t.is("translate")) {
+            vec3 d;
+            if (!vector(d))
+                return false;
+            step = translation(d);
+        }
+        else if (t.is("scale")) {
+            // One factor, or one per axis
+            float f[3];
+            if (!number(f[0]))
+                return false;
+            const char *start = p;
+            token more;
+            if (next(more) && parse_float(more.s, more.s + more.n, f[1])) {
+                p = start;
+                if (!numbers(f + 1, 2))
+                    return false;
+            }
+            else {
+                p = start;
+                f[1] = f[2] = f[0];
+            }
+            step = scaling(vec3(f[0], f[1], f[2]));
+        }
+        else if (t.is("rotate")) {
+            float f[4];
+            if (!numbers(f, 4))
+                return false;
+            step = rotation(vec3(f[0], f[1], f[2]), f[3]);
+        }
+        else if (t.is("matrix")) {
+            if (!numbers(&step.m[0][0], 12))
+                return false;
+        }
+        else
+            return error("unknown transform");
+        to_world = step * to_world;
+    }
+    transform inverse;
+    if (!to_world.inverse(inverse))
+        return error("the transform cannot be inverted");
+    return true;
+}
+
+bool scene_parser::parse(const char *data, size_t size, scene_description &out) {
+    p = data;
+    end = data + size;
+    line = 1;
+    // Primitives go to the scene, or between object and end to the
+    // object being defined
+    std::vector<hittable*> scene_objects, parts;
+    std::string part_of;
+    int instances = 0;
+    while (p < end) {
+        std::vector<hittable*> &objects = part_of.empty() ? scene_objects : parts;
+        token t;
+        if (!next(t)) {
+            end_of_line();
+            continue;
+        }
+        if (t.is("sphere")) {
+            float f[4];
+            if (!numbers(f, 4))
+                return false;
+            material *m = parse_material();
+            if (!m)
+                return false;
+            objects.push_back(memory.make<sphere>(primitive_memory, vec3(f[0], f[1], f[2]), f[3], m));
+        }
+        else if (t.is("moving_sphere")) {
+            float f[9];
+            if (!numbers(f, 9))
+                return false;
+            material *m = parse_material();
+            if (!m)
+                return false;
+            objects.push_back(memory.make<moving_sphere>(primitive_memory, vec3(f[0], f[1], f[2]),
+                                                         vec3(f[3], f[4], f[5]), f[6], f[7], f[8], m));
+        }
+        else if (t.is("plane")) {
+            float f[6];
+            if (!numbers(f, 6))
+                return false;
+            if (!part_of.empty())
+                return error("planes have no bounds and cannot be part of an object");
+            vec3 normal(f[3], f[4], f[5]);
+            if (normal.length() == 0)
+                return error("the plane needs a nonzero normal");
+            material *m = parse_material();
+            if (!m)
+                return false;
+            objects.push_back(memory.make<plane>(primitive_memory, vec3(f[0], f[1], f[2]), normal, m));
+        }
+        else if (t.is("mesh")) {
+            token file;
+            if (!next(file))
+                return error("expected an OBJ file");
+            material *m = parse_material();
+            if (!m)
+                return false;
+            std::string obj = file.str();
+            const char *slash = strrchr(path, '/');
+            if (obj[0] != '/' && slash)
+                obj = std::string(path, slash + 1) + obj;
+            triangle_mesh *mesh = load_obj(obj.c_str(), m);
+            if (!mesh)
+                return error("cannot load the mesh");
+            uint64_t hash;
+            if (!hash_file(obj.c_str(), hash))
+                return error("cannot load the mesh");
+            file_hashes.push_back(hash);
+            objects.push_back(mesh);
+        }
+        else if (t.is("object")) {
+            token name;
+            if (!next(name))
+                return error("expected a name");
+            if (!part_of.empty())
+                return error("objects cannot be nested");
+            part_of = name.str();
+        }
+        else if (t.is("end")) {
+            if (part_of.empty())
+                return error("end without object");
+            if (parts.empty())
+                return error("the object is empty");
+            // A single mesh already has its own BVH
+            hittable *o = parts[0];
+            if (parts.size() > 1 || !dynamic_cast<triangle_mesh*>(o))
+                o = new linear_bvh(parts.data(), int(parts.size()), 0.0, 1.0);
+            shared_objects[part_of] = o;
+            part_of.clear();
+            parts.clear();
+        }
+        else if (t.is("instance")) {
+            token name;
+            if (!next(name))
+                return error("expected an object name");
+            if (!part_of.empty())
+                return error("objects cannot hold instances");
+            auto found = shared_objects.find(name.str());
+            if (found == shared_objects.end())
+                return error("unknown object");
+            transform to_world;
+            if (!parse_transform(to_world))
+                return false;
+            objects.push_back(memory.make<instance>(primitive_memory, found->second, to_world));
+            instances++;
+        }
+        else if (t.is("material") || t.is("texture")) {
+            bool is_material = t.is("material");
+            token name;
+            if (!next(name))
+                return error("expected a name");
+            if (is_material) {
+                material *m = parse_material();
+                if (!m)
+                    return false;
+                materials[name.str()] = m;
+            }
+            else {
+                texture *tex = parse_texture();
+                if (!tex)
+                    return false;
+                textures[name.str()] = tex;
+            }
+        }
+        else if (t.is("camera")) {
+            if (!parse_camera(out.view))
+                return false;
+        }
+        else if (t.is("view")) {
+            token name;
+            view_spec v;
+            v.view = out.view;
+            if (!next(name))
+                return error("expected an output file");
+            v.output = name.str();
+            if (!parse_camera(v.view))
+                return false;
+            out.views.push_back(v);
+        }
+        else if (t.is("keyframe")) {
+            float frame;
+            camera_key key;
+            key.view = out.view;
+            if (!number(frame) || !parse_camera(key.view))
+                return false;
+            key.frame = int(frame);
+            if (!out.keyframes.empty() && key.frame <= out.keyframes.back().frame)
+                return error("keyframes must come in increasing frame order");
+            out.keyframes.push_back(key);
+        }
+        else if (t.is("image")) {
+            float f[3];
+            if (!numbers(f, 3))
+                return false;
+            out.nx = int(f[0]);
+            out.ny = int(f[1]);
+            out.ns = int(f[2]);
+        }
+        else
+            return error("unknown statement");
+        if (!end_of_line())
+            return false;
+    }
+
+    if (!part_of.empty())
+        return error("object without end");
+
+    hittable **list = memory.make_array<hittable*>(scene_objects.size(), list_memory);
+    for (size_t i = 0; i < scene_objects.size(); i++)
+        list[i] = scene_objects[i];
+    out.objects = memory.make<hittable_list>(list_memory, list, int(scene_objects.size()));
+    if (instances > 0)
+        fprintf(stderr, "%d instances of %zu shared objects\n", instances, shared_objects.size());
+    return true;
+}
+
+// Read a scene file, making its objects in memory
+bool load_scene(const char *path, arena &memory, scene_description &out) {
+    auto start = std::chrono::steady_clock::now();
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open scene %s\n", path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    std::vector<char> data(size > 0 ? size : 0);
+    bool ok = fread(data.data(), 1, data.size(), f) == data.size();
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "cannot read scene %s\n", path);
+        return false;
+    }
+
+    scene_parser parser(path, memory);
+    if (!parser.parse(data.data(), data.size(), out))
+        return false;
+    // A change to a mesh changes the scene as much as one to its own text
+    out.hash = hash_bytes(data.data(), data.size());
+    for (size_t i = 0; i < parser.file_hashes.size(); i++)
+        out.hash = mix_seed(out.hash ^ parser.file_hashes[i]);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Loaded %s: %d objects, %.1f MB in %.1f ms (%.0f MB/s), peak memory %.1f MB\n",
+            path, out.objects->list_size, size / 1048576.0, seconds * 1e3,
+            size / 1048576.0 / seconds, peak_memory_mb());
+    return true;
+}
+
+// Reads the views of a file of camera and view lines, written as in a
+// scene file, and adds them to views. They start from base, the scene's
+// camera
+bool load_views(const char *path, const camera_settings &base, std::vector<view_spec> &views) {
+    arena memory;
+    scene_description file;
+    file.view = base;
+    if (!load_scene(path, memory, file))
+        return false;
+    if (file.objects->list_size > 0) {
+        fprintf(stderr, "%s: a views file only holds camera and view lines\n", path);
+        return false;
+    }
+    views.insert(views.end(), file.views.begin(), file.views.end());
+    return true;
+}
+
+// Writes a scene back out as text. Materials and textures used by more
+// than one object get a name, the others are written in place
+class scene_writer {
+    public:
+        bool write(const char *path, const scene_description &s);
+
+    private:
+        std::string texture_spec(texture *t);
+        std::string material_spec(material *m);
+        std::string texture_ref(texture *t);
+        std::string material_ref(material *m);
+        void count_uses(hittable *h);
+        void write_primitive(hittable *h);
+        std::string object_ref(hittable *o);
+
+        FILE *f;
+        std::unordered_map<void*, int> uses;
+        std::unordered_map<void*, std::string> names;
+};
+
+std::string scene_writer::texture_spec(texture *t) {
+    char buf[128];
+    if (constant_texture *c = dynamic_cast<constant_texture*>(t))
+        snprintf(buf, sizeof(buf), "constant %.9g %.9g %.9g", c->color.x(), c->color.y(), c->color.z());
+    else if (checker_texture *c = dynamic_cast<checker_texture*>(t))
+        return "checker " + texture_ref(c->even) + " " + texture_ref(c->odd);
+    else if (plane_checker_texture *c = dynamic_cast<plane_checker_texture*>(t)) {
+        snprintf(buf, sizeof(buf), "plane_checker %.9g ", c->size);
+        return buf + texture_ref(c->even) + " " + texture_ref(c->odd);
+    }
+    else if (noise_texture *n = dynamic_cast<noise_texture*>(t))
+        snprintf(buf, sizeof(buf), "noise %.9g", n->scale);
+    else
+        snprintf(buf, sizeof(buf), "constant 0 0 0");
+    return buf;
+}
+
+// Every texture reachable from a named one is named too, defined first
+std::string scene_writer::texture_ref(texture *t) {
+    auto found = names.find(t);
+    if (found != names.end())
+        return found->second;
+    std::string spec = texture_spec(t);
+    std::string name = "t" + std::to_string(names.size());
+    fprintf(f, "texture %s %s\n", name.c_str(), spec.c_str());
+    names[t] = name;
+    return name;
+}
+
+std::string scene_writer::material_spec(material *m) {
+    char buf[128];
+    if (lambertian *l = dynamic_cast<lambertian*>(m)) {
+        constant_texture *c = dynamic_cast<constant_texture*>(l->albedo);
+        if (c && uses[l->albedo] <= 1) {
+            snprintf(buf, sizeof(buf), "lambertian %.9g %.9g %.9g", c->color.x(), c->color.y(), c->color.z());
+            return buf;
+        }
+        return "lambertian " + texture_ref(l->albedo);
+    }
+    if (metal *mt = dynamic_cast<metal*>(m))
+        snprintf(buf, sizeof(buf), "metal %.9g %.9g %.9g %.9g", mt->albedo.x(), mt->albedo.y(), mt->albedo.z(), mt->fuzz);
+    else if (dielectric *d = dynamic_cast<dielectric*>(m))
+        snprintf(buf, sizeof(buf), "dielectric %.9g", d->ref_idx);
+    else
+        snprintf(buf, sizeof(buf), "lambertian 0 0 0");
+    return buf;
+}
+
+std::string scene_writer::material_ref(material *m) {
+    if (uses[m] <= 1)
+        return material_spec(m);
+    auto found = names.find(m);
+    if (found != names.end())
+        return found->second;
+    std::string spec = material_spec(m);
+    std::string name = "m" + std::to_string(names.size());
+    fprintf(f, "material %s %s\n", name.c_str(), spec.c_str());
+    names[m] = name;
+    return name;
+}
+
+// The primitives of an object: itself, or those under its BVH
+std::vector<hittable*> object_parts(hittable *o) {
+    if (linear_bvh *bvh = dynamic_cast<linear_bvh*>(o))
+        return bvh->prims;
+    return std::vector<hittable*>(1, o);
+}
+
+void scene_writer::count_uses(hittable *h) {
+    if (instance *in = dynamic_cast<instance*>(h)) {
+        // Each shared object counts once
+        if (uses[in->object]++ == 0) {
+            std::vector<hittable*> parts = object_parts(in->object);
+            for (size_t i = 0; i < parts.size(); i++)
+                count_uses(parts[i]);
+        }
+        return;
+    }
+    material *m = nullptr;
+    if (sphere *sp = dynamic_cast<sphere*>(h))
+        m = sp->mat_ptr;
+    else if (moving_sphere *ms = dynamic_cast<moving_sphere*>(h))
+        m = ms->mat_ptr;
+    else if (plane *pl = dynamic_cast<plane*>(h))
+        m = pl->mat_ptr;
+    else if (triangle_mesh *mesh = dynamic_cast<triangle_mesh*>(h))
+        m = mesh->mat_ptr;
+    if (m && uses[m]++ == 0) {
+        if (lambertian *l = dynamic_cast<lambertian*>(m))
+            uses[l->albedo]++;
+    }
+}
+
+// Objects are defined before the first instance of them
+std::string scene_writer::object_ref(hittable *o) {
+    auto found = names.find(o);
+    if (found != names.end())
+        return found->second;
+    std::string name = "o" + std::to_string(names.size());
+    std::vector<hittable*> parts = object_parts(o);
+    fprintf(f, "object %s\n", name.c_str());
+    for (size_t i = 0; i < parts.size(); i++)
+        write_primitive(parts[i]);
+    fprintf(f, "end\n");
+    names[o] = name;
+    return name;
+}
+
+void scene_writer::write_primitive(hittable *h) {
+    if (sphere *sp = dynamic_cast<sphere*>(h)) {
+        std::string mat = material_ref(sp->mat_ptr);
+        fprintf(f, "sphere %.9g %.9g %.9g %.9g %s\n", sp->center.x(), sp->center.y(), sp->center.z(),
+                sp->radius, mat.c_str());
+    }
+    else if (moving_sphere *ms = dynamic_cast<moving_sphere*>(h)) {
+        std::string mat = material_ref(ms->mat_ptr);
+        fprintf(f, "moving_sphere %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %s\n",
+                ms->center0.x(), ms->center0.y(), ms->center0.z(),
+                ms->center1.x(), ms->center1.y(), ms->center1.z(),
+                ms->time0, ms->time1, ms->radius, mat.c_str());
+    }
+    else if (plane *pl = dynamic_cast<plane*>(h)) {
+        std::string mat = material_ref(pl->mat_ptr);
+        fprintf(f, "plane %.9g %.9g %.9g %.9g %.9g %.9g %s\n", pl->point.x(), pl->point.y(), pl->point.z(),
+                pl->normal.x(), pl->normal.y(), pl->normal.z(), mat.c_str());
+    }
+    else if (triangle_mesh *mesh = dynamic_cast<triangle_mesh*>(h)) {
+        if (mesh->source.empty())
+            fprintf(stderr, "skipping a mesh that was not loaded from a file\n");
+        else {
+            std::string mat = material_ref(mesh->mat_ptr);
+            fprintf(f, "mesh %s %s\n", mesh->source.c_str(), mat.c_str());
+        }
+    }
+    else if (instance *in = dynamic_cast<instance*>(h)) {
+        std::string name = object_ref(in->object);
+        fprintf(f, "instance %s matrix", name.c_str());
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 4; c++)
+                fprintf(f, " %.9g", in->to_world.m[r][c]);
+        }
+        fprintf(f, "\n");
+    }
+    else
+        fprintf(stderr, "skipping an object that is not a sphere, plane, mesh or instance\n");
+}
+
+bool scene_writer::write(const char *path, const scene_description &s) {
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "cannot write scene %s\n", path);
+        return false;
+    }
+    const camera_settings &v = s.view;
+    fprintf(f, "image %d %d %d\n", s.nx, s.ny, s.ns);
+    fprintf(f, "camera lookfrom %.9g %.9g %.9g lookat %.9g %.9g %.9g vup %.9g %.9g %.9g vfov %.9g aperture %.9g"
+               " focus %.9g shutter %.9g %.9g\n",
+            v.lookfrom.x(), v.lookfrom.y(), v.lookfrom.z(), v.lookat.x(), v.lookat.y(), v.lookat.z(),
+            v.vup.x(), v.vup.y(), v.vup.z(), v.vfov, v.aperture, v.focus_dist, v.time0, v.time1);
+    for (size_t k = 0; k < s.views.size(); k++) {
+        const camera_settings &vv = s.views[k].view;
+        fprintf(f, "view %s lookfrom %.9g %.9g %.9g lookat %.9g %.9g %.9g vup %.9g %.9g %.9g vfov %.9g"
+                   " aperture %.9g focus %.9g shutter %.9g %.9g\n", s.views[k].output.c_str(),
+                vv.lookfrom.x(), vv.lookfrom.y(), vv.lookfrom.z(), vv.lookat.x(), vv.lookat.y(), vv.lookat.z(),
+                vv.vup.x(), vv.vup.y(), vv.vup.z(), vv.vfov, vv.aperture, vv.focus_dist, vv.time0, vv.time1);
+    }
+    for (size_t k = 0; k < s.keyframes.size(); k++) {
+        const camera_settings &kv = s.keyframes[k].view;
+        fprintf(f, "keyframe %d lookfrom %.9g %.9g %.9g lookat %.9g %.9g %.9g vup %.9g %.9g %.9g vfov %.9g"
+                   " aperture %.9g focus %.9g\n", s.keyframes[k].frame,
+                kv.lookfrom.x(), kv.lookfrom.y(), kv.lookfrom.z(), kv.lookat.x(), kv.lookat.y(), kv.lookat.z(),
+                kv.vup.x(), kv.vup.y(), kv.vup.z(), kv.vfov, kv.aperture, kv.focus_dist);
+    }
+
+    hittable_list *list = s.objects;
+    for (int i = 0; i < list->list_size; i++)
+        count_uses(list->list[i]);
+    for (int i = 0; i < list->list_size; i++)
+        write_primitive(list->list[i]);
+    bool ok = fclose(f) == 0;
+    if (!ok)
+        fprintf(stderr, "cannot write scene %s\n", path);
+    return ok;
+}
+
+bool save_scene(const char *path, const scene_description &s) {
+    scene_writer writer;
+    return writer.write(path, s);
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef SEQUENCEH
+#define SEQUENCEH
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include "arena.h"
+#include "bvh.h"
+#include "bvh_update.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "image.h"
+#include "render.h"
+#include "scene.h"
+#include "tile_scheduler.h"
+
+// The frames of an animation and how they are timed. Frame f opens its
+// shutter at f / fps in scene time and keeps it open for shutter_angle /
+// 360 of a frame, 180 degrees being the usual film shutter
+struct sequence_settings {
+    int first = 0, last = 0;
+    float fps = 24;
+    float shutter_angle = 180;
+
+    float open(int frame) const { return frame / fps; }
+    float close(int frame) const { return (frame + shutter_angle / 360) / fps; }
+};
+
+// Whether output is fit to name frames: either it has no '%' at all, or
+// it has exactly one, starting a %d or %0Nd conversion for the frame
+// number. Anything else would be handed to snprintf as a format
+bool frame_pattern_ok(const char *output) {
+    const char *percent = strchr(output, '%');
+    if (!percent)
+        return true;
+    if (strchr(percent + 1, '%'))
+        return false;
+    const char *c = percent + 1;
+    if (*c == '0') {
+        c++;
+        if (*c < '1' || *c > '9')
+            return false;
+        while (*c >= '0' && *c <= '9')
+            c++;
+    }
+    return *c == 'd';
+}
+
+// The image file of a frame: output formatted with the frame number if it
+// has a conversion like %04d, otherwise output with _NNNN added before
+// the extension. output must pass frame_pattern_ok()
+std::string frame_path(const char *output, int frame) {
+    char name[4096];
+    if (strchr(output, '%'))
+        snprintf(name, sizeof(name), output, frame);
+    else {
+        const char *dot = strrchr(output, '.');
+        int stem = dot ? int(dot - output) : int(strlen(output));
+        snprintf(name, sizeof(name), "%.*s_%04d%s", stem, output, frame, dot ? dot : "");
+    }
+    return name;
+}
+
+// Renders frames seq.first to seq.last of the scene in one process. The
+// worker threads, the scene and its arena and the tree over it stay alive
+// from frame to frame: bvh, built for the first frame's shutter over
+// l[0, n), is refitted to each new shutter, which only touches the
+// primitives that move. world is what rays are traced against, bvh or
+// bvh next to the primitives kept out of it. Each frame is encoded and
+// written on the image writer's thread while the next frame's tree is
+// updated and rendered. If a frame cannot be written the returned samples
+// are 0
+render_stats render_sequence(const sequence_settings &seq, const render_settings &settings,
+                             const scene_description &scene, hittable *world, bvh_node *bvh,
+                             hittable **l, int n, tile_scheduler &scheduler, const char *output, arena &memory) {
+    bvh_updater updater(bvh, l, n, seq.open(seq.first), seq.close(seq.first), memory);
+    framebuffer fb(settings.nx, settings.ny);
+    image_writer writer;
+    render_stats total;
+    total.rays = total.samples = 0;
+    double update_ms = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = seq.first; frame <= seq.last; frame++) {
+        double frame_update_ms = 0;
+        if (frame > seq.first) {
+            updater.set_shutter(seq.open(frame), seq.close(frame));
+            bvh_update_stats u = updater.update();
+            frame_update_ms = u.refit_ms + u.rebuild_ms;
+            update_ms += frame_update_ms;
+        }
+        camera_settings v = camera_at(scene, frame);
+        camera cam(v.lookfrom, v.lookat, v.vup, v.vfov, float(settings.nx) / float(settings.ny),
+                   v.aperture, v.focus_dist, seq.open(frame), seq.close(frame));
+        render_stats stats = render(settings, world, cam, scheduler, fb);
+        total.rays += stats.rays;
+        total.samples += stats.samples;
+
+        std::string path = frame_path(output, frame);
+        writer.write(path.c_str(), fb);
+        fprintf(stderr, "Frame %d: update %.2f ms, render %.2f s, %.2f Mrays/s, writing %s\n",
+                frame, frame_update_ms, stats.seconds, stats.rays / stats.seconds * 1e-6, path.c_str());
+    }
+    bool written = writer.wait();
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int frames = seq.last - seq.first + 1;
+    fprintf(stderr, "%d frames in %.2f s, %.2f s per frame, %.2f ms per frame updating the bvh\n",
+            frames, total.seconds, total.seconds / frames, frames > 1 ? update_ms / (frames - 1) : 0.0);
+    if (!written)
+        total.samples = 0;
+    return total;
+}
+
+#endif
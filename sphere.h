@@ -42,7 +42,8 @@ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
 
     // If there's a ray collision, discrimant > 0
     if (discriminant > 0) {
-        float temp = (-b - sqrt(b*b-a*c))/a;
+        float root = sqrt(discriminant);
+        float temp = (-b - root)/a;
         // Only "count" the ray hit if tmin < t < tmax
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
@@ -52,7 +53,7 @@ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
             return true;
         }
         // Check the other sign of the sqrt
-        temp = (-b + sqrt(b*b-a*c))/a;
+        temp = (-b + root)/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
@@ -0,0 +1,248 @@
+#ifndef SPHERESOAH
+#define SPHERESOAH
+
+#include <vector>
+#include <unordered_map>
+#include "sphere.h"
+#include "moving_sphere.h"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define SPHERE_SOA_SSE 1
+#endif
+
+// A packed leaf tests four spheres for about the cost of one virtual hit()
+// call, or of two box tests, so trees over packed spheres are built with
+// larger leaves
+const int sphere_leaf_size = 8;
+const int sphere_simd_width = 4;
+const float sphere_traversal_cost = 0.5;
+
+// Spheres and moving spheres packed as structure of arrays, in the leaf
+// order of a BVH. A leaf of packed spheres is tested four at a time and
+// only the nearest t and its index come back, the hit_record is filled in
+// once for the winner.
+// A static sphere is stored as a moving sphere that does not move. Slots
+// of primitives that are not spheres have a NaN radius and never hit
+
+// The arrays read while tracing. They point into the vectors of a
+// sphere_soa, or into a mapped compiled scene
+struct sphere_soa_arrays {
+    const float *cx, *cy, *cz;
+    const float *delta_x, *delta_y, *delta_z;
+    const float *time0, *inv_dt;
+    const float *radius;
+    const int *mat;
+    material *const *materials;
+};
+
+class sphere_soa {
+    public:
+        sphere_soa() {}
+        // Append a slot for h. Returns whether h could be packed
+        bool add(hittable *h);
+        // Pad the arrays so a 4 wide load at any slot stays in bounds, and
+        // trace from them
+        void finish();
+        // Trace from arrays held elsewhere, already padded, instead
+        void attach(const sphere_soa_arrays &a, int slots);
+        bool packed(int first, int count) const;
+        static bool can_pack(hittable **l, int n);
+
+        bool nearest(const ray &r, int first, int count, float t_min, float t_max, float &t, int &index) const;
+        void record(const ray &r, int index, float t, hit_record &rec) const;
+        int size() const { return n; }
+        size_t bytes() const {
+            return cx.size() * (10 * sizeof(float) + sizeof(int)) + materials.size() * sizeof(material*);
+        }
+
+        // The center at time is c + ((time - time0) * inv_dt) * delta
+        std::vector<float> cx, cy, cz;
+        std::vector<float> delta_x, delta_y, delta_z;
+        std::vector<float> time0, inv_dt;
+        std::vector<float> radius;
+        std::vector<int> mat;
+        std::vector<material*> materials;
+        sphere_soa_arrays arrays = {};
+
+    private:
+        sphere_soa(const sphere_soa&);
+        sphere_soa &operator=(const sphere_soa&);
+
+        void push(const vec3 &c, const vec3 &delta, float t0, float idt, float r, int m);
+        int material_id(material *m);
+
+        std::unordered_map<material*, int> material_ids;
+        int n = 0;
+};
+
+void sphere_soa::push(const vec3 &c, const vec3 &delta, float t0, float idt, float r, int m) {
+    cx.push_back(c.x());
+    cy.push_back(c.y());
+    cz.push_back(c.z());
+    delta_x.push_back(delta.x());
+    delta_y.push_back(delta.y());
+    delta_z.push_back(delta.z());
+    time0.push_back(t0);
+    inv_dt.push_back(idt);
+    radius.push_back(r);
+    mat.push_back(m);
+}
+
+int sphere_soa::material_id(material *m) {
+    auto found = material_ids.find(m);
+    if (found != material_ids.end())
+        return found->second;
+    int id = int(materials.size());
+    materials.push_back(m);
+    material_ids[m] = id;
+    return id;
+}
+
+bool sphere_soa::add(hittable *h) {
+    n++;
+    if (sphere *s = dynamic_cast<sphere*>(h)) {
+        push(s->center, vec3(0, 0, 0), 0, 0, s->radius, material_id(s->mat_ptr));
+        return true;
+    }
+    if (moving_sphere *s = dynamic_cast<moving_sphere*>(h)) {
+        push(s->center0, s->center1 - s->center0, s->time0, 1 / (s->time1 - s->time0),
+             s->radius, material_id(s->mat_ptr));
+        return true;
+    }
+    push(vec3(0, 0, 0), vec3(0, 0, 0), 0, 0, NAN, -1);
+    return false;
+}
+
+void sphere_soa::finish() {
+    for (int i = 0; i < 3; i++)
+        push(vec3(0, 0, 0), vec3(0, 0, 0), 0, 0, NAN, -1);
+    arrays.cx = cx.data();
+    arrays.cy = cy.data();
+    arrays.cz = cz.data();
+    arrays.delta_x = delta_x.data();
+    arrays.delta_y = delta_y.data();
+    arrays.delta_z = delta_z.data();
+    arrays.time0 = time0.data();
+    arrays.inv_dt = inv_dt.data();
+    arrays.radius = radius.data();
+    arrays.mat = mat.data();
+    arrays.materials = materials.data();
+}
+
+void sphere_soa::attach(const sphere_soa_arrays &a, int slots) {
+    arrays = a;
+    n = slots;
+}
+
+bool sphere_soa::can_pack(hittable **l, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!dynamic_cast<sphere*>(l[i]) && !dynamic_cast<moving_sphere*>(l[i]))
+            return false;
+    }
+    return true;
+}
+
+bool sphere_soa::packed(int first, int count) const {
+    for (int i = first; i < first + count; i++) {
+        if (mat[i] < 0)
+            return false;
+    }
+    return true;
+}
+
+bool sphere_soa::nearest(const ray &r, int first, int count, float t_min, float t_max, float &t, int &index) const {
+    const vec3 &o = r.origin();
+    const vec3 &d = r.direction();
+    float a = dot(d, d);
+    bool hit_anything = false;
+    int end = first + count;
+
+#ifdef SPHERE_SOA_SSE
+    __m128 ox = _mm_set1_ps(o.x()), oy = _mm_set1_ps(o.y()), oz = _mm_set1_ps(o.z());
+    __m128 dx = _mm_set1_ps(d.x()), dy = _mm_set1_ps(d.y()), dz = _mm_set1_ps(d.z());
+    __m128 va = _mm_set1_ps(a);
+    __m128 time = _mm_set1_ps(r.time());
+    __m128 zero = _mm_setzero_ps();
+    __m128 lanes = _mm_set_ps(3, 2, 1, 0);
+    __m128 inf = _mm_set1_ps(MAXFLOAT);
+    for (int base = first; base < end; base += 4) {
+        // Lanes past the end of the range belong to the next leaf
+        __m128 active = _mm_cmplt_ps(lanes, _mm_set1_ps(float(end - base)));
+
+        const sphere_soa_arrays &v = arrays;
+        __m128 s = _mm_mul_ps(_mm_sub_ps(time, _mm_loadu_ps(&v.time0[base])), _mm_loadu_ps(&v.inv_dt[base]));
+        __m128 ocx = _mm_sub_ps(ox, _mm_add_ps(_mm_loadu_ps(&v.cx[base]), _mm_mul_ps(s, _mm_loadu_ps(&v.delta_x[base]))));
+        __m128 ocy = _mm_sub_ps(oy, _mm_add_ps(_mm_loadu_ps(&v.cy[base]), _mm_mul_ps(s, _mm_loadu_ps(&v.delta_y[base]))));
+        __m128 ocz = _mm_sub_ps(oz, _mm_add_ps(_mm_loadu_ps(&v.cz[base]), _mm_mul_ps(s, _mm_loadu_ps(&v.delta_z[base]))));
+        __m128 rad = _mm_loadu_ps(&v.radius[base]);
+
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                              _mm_mul_ps(rad, rad));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+        __m128 valid = _mm_and_ps(active, _mm_cmpgt_ps(disc, zero));
+        if (_mm_movemask_ps(valid) == 0)
+            continue;
+
+        __m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 t_near = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, b), sq), va);
+        __m128 t_far = _mm_div_ps(_mm_add_ps(_mm_sub_ps(zero, b), sq), va);
+        __m128 lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max);
+        __m128 near_ok = _mm_and_ps(_mm_cmplt_ps(t_near, hi), _mm_cmpgt_ps(t_near, lo));
+        __m128 far_ok = _mm_and_ps(_mm_cmplt_ps(t_far, hi), _mm_cmpgt_ps(t_far, lo));
+        __m128 tc = _mm_or_ps(_mm_and_ps(near_ok, t_near), _mm_andnot_ps(near_ok, t_far));
+        valid = _mm_and_ps(valid, _mm_or_ps(near_ok, far_ok));
+        int mask = _mm_movemask_ps(valid);
+        if (mask == 0)
+            continue;
+
+        tc = _mm_or_ps(_mm_and_ps(valid, tc), _mm_andnot_ps(valid, inf));
+        float ts[4];
+        _mm_storeu_ps(ts, tc);
+        for (int k = 0; k < 4; k++) {
+            if ((mask & (1 << k)) && ts[k] < t_max) {
+                t_max = ts[k];
+                t = ts[k];
+                index = base + k;
+                hit_anything = true;
+            }
+        }
+    }
+#else
+    for (int i = first; i < end; i++) {
+        float s = (r.time() - arrays.time0[i]) * arrays.inv_dt[i];
+        vec3 oc = o - vec3(arrays.cx[i] + s*arrays.delta_x[i],
+                           arrays.cy[i] + s*arrays.delta_y[i],
+                           arrays.cz[i] + s*arrays.delta_z[i]);
+        float b = dot(oc, d);
+        float c = dot(oc, oc) - arrays.radius[i]*arrays.radius[i];
+        float disc = b*b - a*c;
+        if (disc > 0) {
+            float sq = sqrt(disc);
+            float temp = (-b - sq) / a;
+            if (!(temp < t_max && temp > t_min))
+                temp = (-b + sq) / a;
+            if (temp < t_max && temp > t_min) {
+                t_max = t = temp;
+                index = i;
+                hit_anything = true;
+            }
+        }
+    }
+#endif
+    return hit_anything;
+}
+
+void sphere_soa::record(const ray &r, int index, float t, hit_record &rec) const {
+    float s = (r.time() - arrays.time0[index]) * arrays.inv_dt[index];
+    vec3 center(arrays.cx[index] + s*arrays.delta_x[index],
+                arrays.cy[index] + s*arrays.delta_y[index],
+                arrays.cz[index] + s*arrays.delta_z[index]);
+    rec.t = t;
+    rec.p = r.point_at_parameter(t);
+    rec.normal = (rec.p - center) / arrays.radius[index];
+    rec.mat_ptr = arrays.materials[arrays.mat[index]];
+}
+
+#endif
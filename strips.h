@@ -0,0 +1,116 @@
+#ifndef STRIPSH
+#define STRIPSH
+
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "render.h"
+#include "image.h"
+
+// Renders images too large to hold in memory. The image is cut into
+// horizontal strips of strip_rows rows, in the order the file stores them:
+// from the top for a ppm, from the bottom for a pfm. The header is written
+// first, and a strip is converted and appended to the file as soon as it
+// and every strip before it are done.
+// Strips are rendered a window of one per worker at a time, so at most
+// that many strip buffers exist at once whatever the size of the image.
+// If the file cannot be written the returned samples are 0
+render_stats render_strips(const render_settings &settings, hittable *world, camera &cam,
+                           tile_scheduler &scheduler, const char *path, int strip_rows) {
+    render_stats stats = { 0, 0, 0 };
+    bool pfm = has_extension(path, ".pfm");
+    if (!pfm && !has_extension(path, ".ppm")) {
+        fprintf(stderr, "strips can only be streamed to a .ppm or .pfm file\n");
+        return stats;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return stats;
+    }
+    std::vector<uint8_t> header = pfm ? pfm_header(settings.nx, settings.ny) : ppm_header(settings.nx, settings.ny);
+    bool ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+
+    int n_strips = (settings.ny + strip_rows - 1) / strip_rows;
+    int window = scheduler.size();
+    linear_bvh *packet_bvh = dynamic_cast<linear_bvh*>(world);
+    std::vector<wavefront_integrator> wavefronts(scheduler.size(), wavefront_integrator(world, settings.path));
+    fprintf(stderr, "Streaming %d strips of %d rows, %.1f MB of strip buffers\n", n_strips, strip_rows,
+            double(window) * strip_rows * settings.nx * (sizeof(vec3) + sizeof(int)) / (1 << 20));
+
+    std::atomic<long long> total_rays(0);
+    std::mutex write_mutex;
+    auto start = std::chrono::steady_clock::now();
+    for (int first = 0; first < n_strips; first += window) {
+        int last = first + window < n_strips ? first + window : n_strips;
+
+        // Strip k covers rows y0 to y1 of the image
+        std::vector<std::unique_ptr<framebuffer> > strips;
+        std::vector<tile> tiles;
+        std::unique_ptr<std::atomic<int>[]> tiles_left(new std::atomic<int>[last - first]);
+        for (int k = first; k < last; k++) {
+            int y0 = pfm ? k * strip_rows : settings.ny - (k + 1) * strip_rows;
+            int y1 = y0 + strip_rows;
+            y0 = y0 < 0 ? 0 : y0;
+            y1 = y1 > settings.ny ? settings.ny : y1;
+            strips.emplace_back(new framebuffer(settings.nx, y1 - y0, y0));
+            std::vector<tile> strip_tiles = make_tiles(settings.nx, y1 - y0, settings.tile_size);
+            for (size_t t = 0; t < strip_tiles.size(); t++) {
+                strip_tiles[t].y0 += y0;
+                strip_tiles[t].y1 += y0;
+            }
+            tiles.insert(tiles.end(), strip_tiles.begin(), strip_tiles.end());
+            tiles_left[k - first] = int(strip_tiles.size());
+        }
+
+        int next = first;
+        scheduler.run(tiles, [&](int worker, const tile &t) {
+            // Find the strip of the tile from its rows. Tiles never cross
+            // strips
+            int k = pfm ? t.y0 / strip_rows : (settings.ny - 1 - t.y0) / strip_rows;
+            framebuffer &fb = *strips[k - first];
+            if (settings.integrator == wavefront_kind)
+                rays_traced += wavefronts[worker].render_tile(t, cam, settings.nx, settings.ny, settings.ns, fb);
+            else if (settings.packets && packet_bvh)
+                render_tile_packets(t, settings, packet_bvh, cam, fb);
+            else
+                render_tile(t, settings, world, cam, fb);
+            total_rays += rays_traced;
+            rays_traced = 0;
+
+            if (--tiles_left[k - first] > 0)
+                return;
+            // Write this strip and any finished ones after it, in file order
+            std::lock_guard<std::mutex> lock(write_mutex);
+            while (next < last && tiles_left[next - first] == 0) {
+                std::unique_ptr<framebuffer> &strip = strips[next - first];
+                std::vector<uint8_t> data;
+                if (pfm)
+                    append_pfm_rows(*strip, data);
+                else
+                    data = rgb8(*strip);
+                ok = fwrite(data.data(), 1, data.size(), f) == data.size() && ok;
+                for (size_t p = 0; p < strip->samples.size(); p++)
+                    stats.samples += strip->samples[p];
+                strip.reset();
+                next++;
+                fprintf(stderr, "\rStreaming (%dx%d) %5.2f%%", settings.nx, settings.ny, 100.0 * next / n_strips);
+            }
+        });
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "\ncannot write %s\n", path);
+        stats.samples = 0;
+    }
+
+    stats.rays = total_rays.load();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "\rStreaming (%dx%d) %5.2f%% on %d threads\n", settings.nx, settings.ny, 100.0, scheduler.size());
+    return stats;
+}
+
+#endif
@@ -36,6 +36,26 @@ class checker_texture : public texture {
         texture *even;
 };
 
+// Squares of side size in x and z, the same at every height, for ground
+// planes. The 3D checker above does not suit them: its sign flips with
+// sin(10*y), which is rounding noise on the plane y = 0
+class plane_checker_texture : public texture {
+    public:
+        plane_checker_texture() {}
+        plane_checker_texture(texture *t0, texture *t1, float s): even(t0), odd(t1), size(s) {}
+        virtual vec3 value(float u, float v, const vec3 &p) const {
+            // Kept in floats, which far points would overflow as ints
+            float cell = floorf(p.x() / size) + floorf(p.z() / size);
+            if (fmodf(cell, 2) != 0)
+                return odd->value(u, v, p);
+            else
+                return even->value(u, v, p);
+        }
+        texture *even;
+        texture *odd;
+        float size;
+};
+
 class noise_texture : public texture {
     public:
         noise_texture() {}
@@ -0,0 +1,157 @@
+#ifndef TILESCHEDULERH
+#define TILESCHEDULERH
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+// A rectangle of pixels [x0, x1) x [y0, y1) of image, which tells the
+// views of a batch apart
+struct tile {
+    int x0, y0, x1, y1;
+    int image;
+};
+
+// Split a nx by ny image into tiles of at most size by size pixels,
+// appended to tiles. Tiles are ordered top row first, matching the order
+// the image is written
+void make_tiles(int nx, int ny, int size, int image, std::vector<tile> &tiles) {
+    for (int y1 = ny; y1 > 0; y1 -= size) {
+        int y0 = y1 - size > 0 ? y1 - size : 0;
+        for (int x0 = 0; x0 < nx; x0 += size) {
+            int x1 = x0 + size < nx ? x0 + size : nx;
+            tiles.push_back({x0, y0, x1, y1, image});
+        }
+    }
+}
+
+std::vector<tile> make_tiles(int nx, int ny, int size) {
+    std::vector<tile> tiles;
+    make_tiles(nx, ny, size, 0, tiles);
+    return tiles;
+}
+
+// A pool of persistent worker threads that render tiles.
+// Every worker owns a deque of tiles. It pops work from the back of its own
+// deque, and once that is empty it steals from the front of the others.
+// Tiles are coarse (hundreds of pixels) so a mutex per deque is cheap
+class tile_scheduler {
+    public:
+        typedef std::function<void(int worker, const tile &t)> tile_job;
+
+        tile_scheduler(int n_threads);
+        ~tile_scheduler();
+
+        // Run job over every tile and block until all of them are done
+        void run(const std::vector<tile> &tiles, const tile_job &job);
+        int size() const { return int(threads.size()); }
+
+    private:
+        struct worker_queue {
+            std::mutex m;
+            std::deque<tile> tiles;
+        };
+
+        void worker_loop(int id);
+        bool pop(int id, tile &t);
+        bool steal(int id, tile &t);
+
+        std::vector<std::thread> threads;
+        std::vector<worker_queue> queues;
+        std::mutex m;
+        std::condition_variable start_cv;
+        std::condition_variable done_cv;
+        const tile_job *job;
+        int generation;
+        int busy;
+        bool quit;
+};
+
+tile_scheduler::tile_scheduler(int n_threads)
+    : queues(n_threads < 1 ? 1 : n_threads), job(nullptr), generation(0), busy(0), quit(false) {
+    for (int i = 0; i < int(queues.size()); i++)
+        threads.push_back(std::thread(&tile_scheduler::worker_loop, this, i));
+}
+
+tile_scheduler::~tile_scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        quit = true;
+    }
+    start_cv.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+void tile_scheduler::run(const std::vector<tile> &tiles, const tile_job &j) {
+    // Hand every worker a contiguous run of tiles so neighbouring tiles,
+    // which touch the same parts of the scene, stay on one core
+    int n = size();
+    for (int w = 0; w < n; w++) {
+        size_t begin = tiles.size() * w / n;
+        size_t end = tiles.size() * (w + 1) / n;
+        std::lock_guard<std::mutex> lock(queues[w].m);
+        queues[w].tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+    }
+
+    std::unique_lock<std::mutex> lock(m);
+    job = &j;
+    busy = n;
+    generation++;
+    start_cv.notify_all();
+    done_cv.wait(lock, [this]{ return busy == 0; });
+    job = nullptr;
+}
+
+bool tile_scheduler::pop(int id, tile &t) {
+    std::lock_guard<std::mutex> lock(queues[id].m);
+    if (queues[id].tiles.empty())
+        return false;
+    t = queues[id].tiles.back();
+    queues[id].tiles.pop_back();
+    return true;
+}
+
+bool tile_scheduler::steal(int id, tile &t) {
+    int n = size();
+    for (int k = 1; k < n; k++) {
+        worker_queue &victim = queues[(id + k) % n];
+        std::lock_guard<std::mutex> lock(victim.m);
+        if (!victim.tiles.empty()) {
+            t = victim.tiles.front();
+            victim.tiles.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void tile_scheduler::worker_loop(int id) {
+    int seen = 0;
+    for (;;) {
+        const tile_job *current;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            start_cv.wait(lock, [&]{ return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+            current = job;
+        }
+
+        // No tiles are added while a run is in flight, so once our deque
+        // and every victim's deque are empty this worker is done
+        tile t;
+        while (pop(id, t) || steal(id, t))
+            (*current)(id, t);
+
+        std::lock_guard<std::mutex> lock(m);
+        if (--busy == 0)
+            done_cv.notify_all();
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef WAVEFRONTH
+#define WAVEFRONTH
+
+#include <vector>
+#include "camera.h"
+#include "material.h"
+#include "integrator.h"
+#include "framebuffer.h"
+#include "tile_scheduler.h"
+
+// A path tracer organised in stages over a pool of paths instead of one
+// recursive call per ray. Every sample of every pixel of a tile starts in
+// the pool. Each round then
+//   extend:  intersects every live path with the world
+//   shade:   ends paths that missed, bins the rest by material kind, and
+//            runs one non-virtual scatter() kernel per bin
+//   compact: drops finished paths so the next round only sees live ones
+// Each path draws from the same stream as trace_path(), so the two
+// integrators trace the same paths and differ only by rounding
+class wavefront_integrator {
+    public:
+        wavefront_integrator(hittable *w, const path_options &o) : world(w), options(o) {}
+
+        // Render ns samples of every pixel in t. Returns the rays traced
+        long long render_tile(const tile &t, camera &cam, int nx, int ny, int ns, framebuffer &fb);
+
+    private:
+        struct path {
+            ray r;
+            vec3 throughput;
+            rng random;
+            int pixel;
+            int depth;
+        };
+
+        template <class M> void shade_batch(const std::vector<int> &batch);
+
+        hittable *world;
+        path_options options;
+        std::vector<path> paths;
+        std::vector<hit_record> hits;
+        std::vector<char> hit;
+        std::vector<int> batches[material_kinds];
+        std::vector<vec3> accum;
+};
+
+// A path whose scatter() fails or that loses the Russian roulette is
+// absorbed. Its depth is set to -1 so the compaction stage drops it
+// without adding anything to the pixel
+template <class M>
+void wavefront_integrator::shade_batch(const std::vector<int> &batch) {
+    for (size_t b = 0; b < batch.size(); b++) {
+        int i = batch[b];
+        path &p = paths[i];
+        const M *m = static_cast<const M*>(hits[i].mat_ptr);
+        vec3 attenuation;
+        ray scattered;
+        if (p.depth < options.max_depth && m->M::scatter(p.r, hits[i], attenuation, scattered, p.random)) {
+            p.throughput *= attenuation;
+            p.r = scattered;
+            p.depth++;
+            if (!russian_roulette(p.throughput, p.depth, options, p.random))
+                p.depth = -1;
+        }
+        else
+            p.depth = -1;
+    }
+}
+
+long long wavefront_integrator::render_tile(const tile &t, camera &cam, int nx, int ny, int ns, framebuffer &fb) {
+    int width = t.x1 - t.x0;
+    int n_pixels = width * (t.y1 - t.y0);
+    accum.assign(n_pixels, vec3(0, 0, 0));
+
+    // Generate: one path per sample of every pixel
+    paths.resize(n_pixels * ns);
+    int n = 0;
+    for (int j = t.y0; j < t.y1; j++) {
+        for (int i = t.x0; i < t.x1; i++) {
+            for (int s = 0; s < ns; s++) {
+                path &p = paths[n++];
+                p.random = pixel_rng(i, j, nx, s);
+                float u = float(i + p.random.next_float()) / float(nx);
+                float v = float(j + p.random.next_float()) / float(ny);
+                p.r = cam.get_ray(u, v, p.random);
+                p.throughput = vec3(1, 1, 1);
+                p.pixel = (j - t.y0) * width + (i - t.x0);
+                p.depth = 0;
+            }
+        }
+    }
+
+    long long rays = 0;
+    while (n > 0) {
+        // Extend
+        hits.resize(n);
+        hit.resize(n);
+        for (int i = 0; i < n; i++)
+            hit[i] = world->hit(paths[i].r, 0.001, MAXFLOAT, hits[i]);
+        rays += n;
+
+        // Shade. Misses pick up the sky and finish, hits are binned by
+        // material so each kernel runs over a batch of the same code
+        for (int k = 0; k < material_kinds; k++)
+            batches[k].clear();
+        for (int i = 0; i < n; i++) {
+            if (hit[i])
+                batches[hits[i].mat_ptr->kind].push_back(i);
+            else {
+                accum[paths[i].pixel] += paths[i].throughput * sky(paths[i].r);
+                paths[i].depth = -1;
+            }
+        }
+        shade_batch<lambertian>(batches[lambertian_kind]);
+        shade_batch<metal>(batches[metal_kind]);
+        shade_batch<dielectric>(batches[dielectric_kind]);
+
+        // Compact
+        int live = 0;
+        for (int i = 0; i < n; i++) {
+            if (paths[i].depth >= 0)
+                paths[live++] = paths[i];
+        }
+        n = live;
+    }
+
+    for (int j = t.y0; j < t.y1; j++) {
+        for (int i = t.x0; i < t.x1; i++) {
+            vec3 col = accum[(j - t.y0) * width + (i - t.x0)];
+            col /= float(ns);
+            fb.at(i, j) = col;
+            fb.samples_at(i, j) = ns;
+        }
+    }
+    return rays;
+}
+
+#endif